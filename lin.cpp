@@ -19,11 +19,37 @@
 #include <algorithm>
 #include <deque>
 #include <sys/inotify.h>
+#include <spawn.h>
+#include <chrono>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <functional>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <shadow.h>
+#include <poll.h>
+#include <termios.h>
+#include <memory>
+#include <climits>
+#include <string_view>
+#include <memory_resource>
+#include <list>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <ftw.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-volatile sig_atomic_t sighup_received = 0;
-
 struct UserInfo {
     string username;
     string uid;
@@ -32,36 +58,138 @@ struct UserInfo {
     string shell;
 };
 
+// Неизменяемый снимок таблицы пользователей. Поток VFS собирает новый
+// снимок целиком и публикует его атомарной заменой указателя; читатели
+// берут shared_ptr и дальше работают со своей копией без синхронизации,
+// старый снимок освобождается вместе с последним читателем. Сама замена
+// и взятие указателя не lock-free: atomic_load/atomic_store для shared_ptr
+// в libstdc++ берут мьютекс из общего пула (в C++20 они устарели, там
+// используется atomic<shared_ptr>, который тоже держит блокировку на
+// время копирования). Блокировка короткая — только на копирование
+// указателя и счётчик ссылок, не на время работы со снимком.
+// Индексы строятся там же, при публикации: хеши по имени и uid и два
+// отсортированных массива — по имени (для префиксов) и по uid (для
+// диапазонов).
+struct UserSnapshot {
+    vector<UserInfo> users;
+    vector<long> uids;
+    unordered_map<string, size_t> by_name;
+    unordered_multimap<long, size_t> by_uid;
+    vector<size_t> name_order;
+    vector<size_t> uid_order;
+    unsigned long generation = 0;
+};
+
+#if __cpp_lib_atomic_shared_ptr >= 201711L
+atomic<shared_ptr<const UserSnapshot>> users_snapshot_ptr;
+
+shared_ptr<const UserSnapshot> users_snapshot() {
+    return users_snapshot_ptr.load();
+}
+
+static void store_users_snapshot(shared_ptr<const UserSnapshot> next) {
+    users_snapshot_ptr.store(move(next));
+}
+#else
+shared_ptr<const UserSnapshot> users_snapshot_ptr;
+
+shared_ptr<const UserSnapshot> users_snapshot() {
+    return atomic_load(&users_snapshot_ptr);
+}
+
+static void store_users_snapshot(shared_ptr<const UserSnapshot> next) {
+    atomic_store(&users_snapshot_ptr, move(next));
+}
+#endif
+
+void publish_users(vector<UserInfo> users) {
+    auto next = make_shared<UserSnapshot>();
+    auto prev = users_snapshot();
+    next->generation = prev ? prev->generation + 1 : 1;
+    next->users = move(users);
+
+    size_t n = next->users.size();
+    next->uids.reserve(n);
+    next->by_name.reserve(n);
+    next->by_uid.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        long uid = atol(next->users[i].uid.c_str());
+        next->uids.push_back(uid);
+        next->by_name.emplace(next->users[i].username, i);
+        next->by_uid.emplace(uid, i);
+        next->name_order.push_back(i);
+    }
+    next->uid_order = next->name_order;
+    auto& s = *next;
+    sort(s.name_order.begin(), s.name_order.end(), [&s](size_t a, size_t b) {
+        return s.users[a].username < s.users[b].username;
+    });
+    sort(s.uid_order.begin(), s.uid_order.end(),
+         [&s](size_t a, size_t b) { return s.uids[a] < s.uids[b]; });
+
+    store_users_snapshot(move(next));
+}
+
 string users_dir;
-vector<UserInfo> users_list;
-deque<string> history;
-const int MAX_HISTORY = 100;
-string history_file;
+string passwd_file = "/etc/passwd";
+// История — кольцо из MAX_HISTORY строк: новая строка пишется на место
+// самой старой и занимает её память, а файл истории открыт всё время.
+// Так запись истории после прогрева не обращается к куче.
+vector<string> history;
+size_t history_next = 0;   // самая старая строка, когда кольцо заполнено
+const size_t MAX_HISTORY = 100;
+int history_fd = -1;
+
+vector<int> pipe_status;    // коды завершения стадий последнего конвейера
+int default_pipe_size = 0;
 
 atomic<bool> running(true);
 
+// Слова одной команды; при разборе строки живут в пуле parse_cache
+using Args = pmr::vector<pmr::string>;
+
 // forward declarations
 void sync_vfs_with_passwd();
+void request_vfs_sync();
+bool watch_users_dir();
+void watch_shard_dir(const char* shard);
+string user_vfs_path(const string& name);
+void take_vfs_edits(unordered_map<string, unsigned>& edits, bool& overflow);
+void sync_user_watches();
+void forget_user_watches();
+bool note_own_vfs_event(const string& path);
+void cancel_own_vfs_event(const string& path);
+void builtin_vfsstat(ostream& out);
+void builtin_account_batch(const Args& args, ostream& out);
+void builtin_parsecache(ostream& out);
 void load_history();
 void save_history(const string& cmd);
 
 // ================= Сигналы =================
 
-void sighup_handler(int sig) {
-    if (sig == SIGHUP) {
-        const char* msg = "Configuration reloaded\n";
-        write(STDOUT_FILENO, msg, strlen(msg));
-        sighup_received = 1;
-        sync_vfs_with_passwd();
-    }
+// SIGHUP, SIGCHLD и SIGINT не имеют обработчиков: они заблокированы во всех
+// потоках и читаются из signalfd в цикле событий. Маску ставим до создания
+// потоков, чтобы её унаследовали все.
+void setup_signal_handlers() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    signal(SIGPIPE, SIG_IGN);
+    // tcsetpgrp из шелла при fg не должен его останавливать
+    signal(SIGTTOU, SIG_IGN);
 }
 
-void setup_signal_handlers() {
-    struct sigaction sa{};
-    sa.sa_handler = sighup_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGHUP, &sa, nullptr);
+int open_signal_fd() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGINT);
+    return signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
 }
 
 // ================= История =================
@@ -72,7 +200,8 @@ void load_history() {
         return;
     }
    
-    history_file = string(home) + "/.kubsh_history";
+    string history_file = string(home) + "/.kubsh_history";
+    history.reserve(MAX_HISTORY);
    
     ifstream file(history_file);
     if (file) {
@@ -83,304 +212,4820 @@ void load_history() {
             }
         }
     }
+    history_fd = open(history_file.c_str(),
+                      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
 }
 
 void save_history(const string& cmd) {
     if (cmd.empty() || cmd == "\\q") return;
    
-    history.push_back(cmd);
-    if (history.size() > MAX_HISTORY) {
-        history.pop_front();
+    if (history.size() < MAX_HISTORY) {
+        history.push_back(cmd);
+    } else {
+        history[history_next] = cmd;
+        history_next = (history_next + 1) % MAX_HISTORY;
     }
    
-    ofstream file(history_file, ios::app);
-    if (file) {
-        file << cmd << endl;
+    if (history_fd >= 0) {
+        iovec iov[2] = {{const_cast<char*>(cmd.data()), cmd.size()},
+                        {const_cast<char*>("\n"), 1}};
+        if (writev(history_fd, iov, 2) < 0) {
+            perror("history");
+            close(history_fd);
+            history_fd = -1;
+        }
     }
 }
 
-// ================= Утилиты =================
+// ================= Арена команды =================
 
-vector<string> split_args(const string& input) {
-    vector<string> args;
-    istringstream iss(input);
-    string token;
-    while (iss >> token) args.push_back(token);
-    return args;
+// Всё, что живёт одну командную строку — перенаправления, argv и
+// служебные массивы run_pipeline, — выделяется из command_arena через
+// pmr-контейнеры (сам разбор строки живёт в кеше разобранных строк,
+// см. parse_cache). Арена — это bump-указатель по
+// блокам; освобождение отдельных объектов ничего не делает, память
+// возвращается целиком в reset() после строки. Если строке не хватило
+// блока, при сбросе блоки сливаются в один размером с суммарный, так что
+// повторяющиеся команды в установившемся режиме кучу не трогают.
+// Проверяется счётчиком operator new (\arena) за весь путь строки — чтение
+// stdin, история, разбор и запуск (см. on_stdin). Встроенные стадии
+// переднего плана идут в постоянных потоках (StageWorker), так что и
+// конвейер со встроенной командой после первого запуска обходится без
+// кучи; выделения самих встроенных команд делаются в этих потоках и
+// в счётчик строки не входят. Фоновое задание со встроенной стадией
+// по-прежнему выделяет память: её вывод копится в строке, а пишет его
+// отдельный поток.
+
+atomic<unsigned long> heap_allocations{0};
+thread_local unsigned long thread_heap_allocations = 0;
+
+void* operator new(size_t size) {
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    ++thread_heap_allocations;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
 }
 
-// ================= Встроенные команды =================
+// noinline: иначе GCC видит free() на указателе от operator new
+// и предупреждает о несовпадении пары (-Wmismatched-new-delete)
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
 
-void builtin_echo(const vector<string>& args) {
-    for (size_t i = 1; i < args.size(); ++i) {
-        string s = args[i];
-        if (s.size() >= 2 &&
-            ((s.front() == '"' && s.back() == '"') ||
-             (s.front() == '\'' && s.back() == '\'')))
-            s = s.substr(1, s.size() - 2);
-        cout << s;
-        if (i + 1 < args.size()) cout << " ";
+class CommandArena : public pmr::memory_resource {
+public:
+    static const size_t FIRST_BLOCK = 16 << 10;
+
+    ~CommandArena() {
+        for (auto& b : blocks_) free(b.data);
     }
-    cout << endl;
-}
 
-void builtin_env(const vector<string>& args) {
-    if (args.size() < 2) {
-        cout << "Usage: \\e $VARIABLE" << endl;
-        return;
+    // Освобождает всё, выделенное за строку.
+    void reset() {
+        high_water_ = max(high_water_, used_);
+        last_used_ = used_;
+        if (blocks_.size() > 1) {
+            size_t total = 0;
+            for (auto& b : blocks_) {
+                total += b.size;
+                free(b.data);
+            }
+            blocks_.clear();
+            add_block(total);
+        }
+        current_ = 0;
+        offset_ = 0;
+        used_ = 0;
     }
-   
-    string var = args[1];
-    if (!var.empty() && var[0] == '$') {
-        var = var.substr(1);
+
+    size_t last_used() const { return last_used_; }
+    size_t high_water() const { return max(high_water_, used_); }
+    size_t capacity() const {
+        size_t total = 0;
+        for (auto& b : blocks_) total += b.size;
+        return total;
     }
-   
-    const char* val = getenv(var.c_str());
-    if (!val) {
-        cout << "Variable $" << var << " not found" << endl;
-        return;
+    unsigned long block_allocs() const { return block_allocs_; }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    vector<Block> blocks_;
+    size_t current_ = 0;   // блок, из которого сейчас выделяем
+    size_t offset_ = 0;
+    size_t used_ = 0;
+    size_t last_used_ = 0;
+    size_t high_water_ = 0;
+    unsigned long block_allocs_ = 0;
+
+    void add_block(size_t size) {
+        char* data = static_cast<char*>(malloc(size));
+        if (!data) throw bad_alloc();
+        blocks_.push_back({data, size});
+        ++block_allocs_;
     }
 
-    string v(val);
-    if (v.find(':') != string::npos) {
-        stringstream ss(v);
-        string part;
-        while (getline(ss, part, ':'))
-            cout << part << endl;
-    } else {
-        cout << v << endl;
+    void* do_allocate(size_t bytes, size_t align) override {
+        for (;;) {
+            if (current_ < blocks_.size()) {
+                Block& b = blocks_[current_];
+                size_t start = (offset_ + align - 1) & ~(align - 1);
+                if (start + bytes <= b.size) {
+                    used_ += start + bytes - offset_;
+                    offset_ = start + bytes;
+                    return b.data + start;
+                }
+                if (current_ + 1 < blocks_.size()) {
+                    ++current_;
+                    offset_ = 0;
+                    continue;
+                }
+            }
+            size_t last = blocks_.empty() ? FIRST_BLOCK / 2 : blocks_.back().size;
+            add_block(max(last * 2, bytes + align));
+            current_ = blocks_.size() - 1;
+            offset_ = 0;
+        }
     }
-}
 
-void builtin_disk_info(const vector<string>& args) {
-    if (args.size() < 2) {
-        cout << "Usage: \\l /dev/device" << endl;
-        cout << "Example: \\l /dev/sda" << endl;
-        return;
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+        return this == &other;
     }
-   
-    string device = args[1];
-    string cmd = "lsblk " + device + " 2>/dev/null";
-    int result = system(cmd.c_str());
-   
-    if (result != 0) {
-        cmd = "fdisk -l " + device + " 2>/dev/null";
-        system(cmd.c_str());
+};
+
+CommandArena command_arena;
+
+// Выделения в куче основным потоком за последнюю строку и сколько строк
+// обошлись без них.
+struct ArenaStats {
+    unsigned long commands = 0;
+    unsigned long heap_free_commands = 0;
+    unsigned long last_heap_allocs = 0;
+};
+
+ArenaStats arena_stats;
+
+// Счётчики арены для \\arena. Основной поток выделяет из арены, пока
+// стадии конвейера работают в своих потоках, поэтому \\arena читает копию,
+// снятую основным потоком перед запуском конвейера.
+struct ArenaUsage {
+    size_t last_used = 0;
+    size_t high_water = 0;
+    size_t capacity = 0;
+    unsigned long block_allocs = 0;
+};
+
+ArenaUsage arena_usage;
+
+// ================= Утилиты =================
+
+// ~ и ~user в начале слова. Домашний каталог берётся из снимка
+// пользователей без блокировок; кого там нет (например, системные
+// учётные записи без shell) — через getpwnam.
+void expand_tilde(pmr::string& word) {
+    if (word.empty() || word[0] != '~') return;
+    size_t slash = word.find('/');
+    size_t end = slash == string::npos ? word.size() : slash;
+
+    string_view home;
+    shared_ptr<const UserSnapshot> snapshot;
+    struct passwd* pw = nullptr;
+    if (end == 1) {
+        const char* h = getenv("HOME");
+        if (!h) return;
+        home = h;
+    } else {
+        string name(word, 1, end - 1);
+        snapshot = users_snapshot();
+        const UserInfo* u = nullptr;
+        if (snapshot) {
+            auto it = snapshot->by_name.find(name);
+            if (it != snapshot->by_name.end()) u = &snapshot->users[it->second];
+        }
+        if (u) {
+            home = u->home;
+        } else if ((pw = getpwnam(name.c_str()))) {
+            home = pw->pw_dir;
+        } else {
+            return;
+        }
     }
+    word.replace(0, end, home);
 }
 
-bool handle_builtins(const vector<string>& args) {
-    if (args.empty()) return true;
+// ================= Лексер =================
 
-    if (args[0] == "echo") {
-        builtin_echo(args);
-        return true;
+// Командная строка разбирается за один проход в токены-string_view.
+// Слово без кавычек и '\' — срез самой строки; слово, из которого сняты
+// кавычки, собирается в Lexer::buf. buf заранее резервируется под длину
+// строки (снятие кавычек её только укорачивает), так что срезы не
+// инвалидируются, а tokens и buf переиспользуются: после прогрева
+// разбор не выделяет память.
+//  '...'  — всё буквально;
+//  "..."  — '\' экранирует только \ " $ ` и перевод строки;
+//  \c     — вне кавычек c буквально, если c — пробел, кавычка, '\',
+//          оператор, $, ` или ~; иначе '\' остаётся в слове (\users,
+//          \e и другие встроенные команды пишутся с ним);
+//  | < > >> & ;  — операторы, если не в кавычках и не экранированы.
+
+enum class TokKind : unsigned char { Word, Pipe, In, Out, Append, Amp, Semi };
+
+struct Token {
+    TokKind kind;
+    bool quoted;        // были кавычки или '\' — ~ не раскрывается
+    string_view text;   // слово без кавычек / текст оператора
+    string_view src;    // исходный текст токена в строке
+};
+
+struct Lexer {
+    vector<Token> tokens;
+    string buf;
+};
+
+static inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline bool is_operator(char c) {
+    return c == '|' || c == '<' || c == '>' || c == '&' || c == ';';
+}
+
+static inline bool is_escapable(char c) {
+    return is_blank(c) || is_operator(c) || strchr("\\'\"$`~", c);
+}
+
+// ---------- Поиск особых байтов ----------
+
+// Лексеру важны только пробелы, кавычки, '\' и операторы; всё между ними
+// копируется или пропускается целиком. scan_special(p, n) возвращает
+// индекс первого такого байта (или n). Векторные версии сравнивают 16
+// (SSE2) или 32 (AVX2) байта за раз с каждым из особых символов; версия
+// выбирается при старте по CPUID, на остальных архитектурах — таблица.
+
+enum class ScanImpl { Scalar, Sse2, Avx2 };
+
+static const char SPECIAL_BYTES[] = " \t\n\r'\"\\|<>&;";
+
+struct SpecialTable {
+    bool special[256] = {};
+    SpecialTable() {
+        for (const char* c = SPECIAL_BYTES; *c; ++c)
+            special[static_cast<unsigned char>(*c)] = true;
     }
-    if (args[0] == "\\e") {
-        builtin_env(args);
-        return true;
+};
+
+static const SpecialTable special_table;
+
+static size_t scan_special_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && !special_table.special[static_cast<unsigned char>(p[i])]) ++i;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// В обычных командах особый байт встречается каждые 5–6 байт, и до
+// векторного цикла дело бы не доходило: первые SCAN_HEAD байт дешевле
+// проверить таблицей.
+const size_t SCAN_HEAD = 8;
+
+static inline size_t scan_special_head(const char* p, size_t n) {
+    size_t i = 0, end = min(n, SCAN_HEAD);
+    while (i < end && !special_table.special[static_cast<unsigned char>(p[i])]) ++i;
+    return i;
+}
+
+// Константы собираются один раз на вызов, сравнения развёрнуты вручную:
+// цикл по SPECIAL_BYTES GCC не разворачивает и пересобирает их на каждые
+// 16 байт.
+__attribute__((target("sse2")))
+static size_t scan_special_sse2(const char* p, size_t n) {
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'),
+                  nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'),
+                  sq = _mm_set1_epi8('\''), dq = _mm_set1_epi8('"'),
+                  bs = _mm_set1_epi8('\\'), bar = _mm_set1_epi8('|'),
+                  lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'),
+                  amp = _mm_set1_epi8('&'), semi = _mm_set1_epi8(';');
+    size_t i = scan_special_head(p, n);
+    if (i < SCAN_HEAD || i == n) return i;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i a = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sq), _mm_cmpeq_epi8(v, dq)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, bar)));
+        __m128i c = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, semi)));
+        if (unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), c)))
+            return i + __builtin_ctz(mask);
     }
-    if (args[0] == "\\l") {
-        builtin_disk_info(args);
-        return true;
+    return i + scan_special_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_special_avx2(const char* p, size_t n) {
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'),
+                  nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r'),
+                  sq = _mm256_set1_epi8('\''), dq = _mm256_set1_epi8('"'),
+                  bs = _mm256_set1_epi8('\\'), bar = _mm256_set1_epi8('|'),
+                  lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'),
+                  amp = _mm256_set1_epi8('&'), semi = _mm256_set1_epi8(';');
+    size_t i = scan_special_head(p, n);
+    if (i < SCAN_HEAD || i == n) return i;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i a = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr)));
+        __m256i b = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sq), _mm256_cmpeq_epi8(v, dq)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, bs), _mm256_cmpeq_epi8(v, bar)));
+        __m256i c = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, semi)));
+        if (unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(a, b), c)))
+            return i + __builtin_ctz(mask);
     }
-    return false;
+    return i + scan_special_scalar(p + i, n - i);
 }
+#endif
 
-// ================= Выполнение команд =================
+using ScanFn = size_t (*)(const char*, size_t);
 
-void execute_command(const string& input) {
-    vector<string> args = split_args(input);
-    if (args.empty()) return;
+static ScanImpl best_scan_impl() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return ScanImpl::Avx2;
+    if (__builtin_cpu_supports("sse2")) return ScanImpl::Sse2;
+#endif
+    return ScanImpl::Scalar;
+}
 
-    if (handle_builtins(args))
-        return;
+static ScanFn scan_fn(ScanImpl impl) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (impl == ScanImpl::Avx2) return scan_special_avx2;
+    if (impl == ScanImpl::Sse2) return scan_special_sse2;
+#endif
+    return scan_special_scalar;
+}
 
-    vector<char*> c_args;
-    for (auto& a : args)
-        c_args.push_back(const_cast<char*>(a.c_str()));
-    c_args.push_back(nullptr);
+static const char* scan_impl_name(ScanImpl impl) {
+    return impl == ScanImpl::Avx2 ? "avx2" : impl == ScanImpl::Sse2 ? "sse2" : "scalar";
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        execvp(c_args[0], c_args.data());
+ScanImpl scan_impl = best_scan_impl();
+ScanFn scan_special = scan_fn(scan_impl);
+
+// Переключает реализацию (--lexer-scan, бенчмарк). false — CPU не умеет.
+bool set_scan_impl(ScanImpl impl) {
+    if (impl > best_scan_impl()) return false;
+    scan_impl = impl;
+    scan_special = scan_fn(impl);
+    return true;
+}
 
-        cout << args[0] << ": command not found" << endl;
-        exit(127);
-    } else if (pid > 0) {
-        waitpid(pid, nullptr, 0);
+bool tokenize(string_view line, Lexer& lx, string& error) {
+    lx.tokens.clear();
+    lx.buf.clear();
+    lx.buf.reserve(line.size());
+
+    size_t i = 0, n = line.size();
+    while (i < n) {
+        char c = line[i];
+        if (is_blank(c)) {
+            ++i;
+            continue;
+        }
+        if (is_operator(c)) {
+            size_t len = 1;
+            TokKind kind = c == '|' ? TokKind::Pipe : c == '<' ? TokKind::In :
+                           c == '&' ? TokKind::Amp : c == ';' ? TokKind::Semi :
+                           TokKind::Out;
+            if (c == '>' && i + 1 < n && line[i + 1] == '>') {
+                kind = TokKind::Append;
+                len = 2;
+            }
+            string_view op = line.substr(i, len);
+            lx.tokens.push_back({kind, false, op, op});
+            i += len;
+            continue;
+        }
+
+        // Слово: пока не встретились кавычки или '\', это срез line;
+        // с первой такой встречи текст копируется в buf.
+        size_t start = i;
+        size_t copy_from = string::npos;   // начало слова в buf
+        size_t plain = i;                  // ещё не скопированный хвост
+        auto begin_copy = [&]() {
+            if (copy_from == string::npos) copy_from = lx.buf.size();
+            lx.buf.append(line.data() + plain, i - plain);
+        };
+        auto unterminated = [&](size_t open) {
+            error = "unexpected EOF while looking for matching `";
+            error += line[open];
+            error += '\'';
+            return false;
+        };
+        for (;;) {
+            // Обычные байты слова пропускаются пачкой
+            i += scan_special(line.data() + i, n - i);
+            if (i >= n || is_blank(line[i]) || is_operator(line[i])) break;
+
+            char q = line[i];
+            if (q == '\\') {
+                if (i + 1 < n && is_escapable(line[i + 1])) {
+                    begin_copy();
+                    lx.buf += line[++i];
+                    plain = i + 1;
+                }
+                ++i;
+            } else if (q == '\'') {
+                begin_copy();
+                size_t open = i++;
+                auto close = static_cast<const char*>(
+                    memchr(line.data() + i, '\'', n - i));
+                if (!close) return unterminated(open);
+                size_t end = close - line.data();
+                lx.buf.append(line.data() + i, end - i);
+                i = plain = end + 1;
+            } else {
+                begin_copy();
+                size_t open = i++;
+                for (;;) {
+                    size_t run = scan_special(line.data() + i, n - i);
+                    lx.buf.append(line.data() + i, run);
+                    i += run;
+                    if (i >= n) return unterminated(open);
+                    if (line[i] == '"') break;
+                    if (line[i] == '\\' && i + 1 < n &&
+                        strchr("\\\"$`\n", line[i + 1]))
+                        ++i;
+                    lx.buf += line[i++];
+                }
+                plain = ++i;
+            }
+        }
+
+        string_view src = line.substr(start, i - start);
+        if (copy_from == string::npos) {
+            lx.tokens.push_back({TokKind::Word, false, src, src});
+        } else {
+            lx.buf.append(line.data() + plain, i - plain);
+            string_view text(lx.buf.data() + copy_from, lx.buf.size() - copy_from);
+            lx.tokens.push_back({TokKind::Word, true, text, src});
+        }
     }
+    return true;
 }
 
-// ================= VFS =================
+// ================= Запуск процессов =================
 
-vector<UserInfo> get_system_users() {
-    vector<UserInfo> users;
-    ifstream f("/etc/passwd");
-    string line;
+// posix_spawn в glibc создаёт потомка через clone(CLONE_VM|CLONE_VFORK):
+// таблицы страниц шелла не копируются, поэтому стоимость запуска не растёт
+// вместе с RSS. fork+execvp оставлен как запасной путь.
+enum class SpawnBackend { Spawn, Fork };
+SpawnBackend spawn_backend = SpawnBackend::Spawn;
 
-    while (getline(f, line)) {
-        stringstream ss(line);
-        vector<string> p;
-        string part;
-        while (getline(ss, part, ':')) p.push_back(part);
+extern char** environ;
+
+// allocator_type: в pmr::vector<Redirect> путь выделяется из того же
+// ресурса, что и сам вектор, в том числе при копировании.
+struct Redirect {
+    using allocator_type = pmr::polymorphic_allocator<char>;
+
+    int fd;             // дескриптор в потомке
+    pmr::string path;   // открываемый файл; если пусто — dup2(src_fd, fd)
+    int flags;
+    int src_fd;
+
+    Redirect(int fd, string_view path, int flags, int src_fd,
+             const allocator_type& alloc = {})
+        : fd(fd), path(path, alloc), flags(flags), src_fd(src_fd) {}
+    Redirect(const Redirect& r, const allocator_type& alloc = {})
+        : fd(r.fd), path(r.path, alloc), flags(r.flags), src_fd(r.src_fd) {}
+    Redirect(Redirect&& r, const allocator_type& alloc)
+        : fd(r.fd), path(move(r.path), alloc), flags(r.flags), src_fd(r.src_fd) {}
+    Redirect(Redirect&&) = default;
+    Redirect& operator=(const Redirect&) = default;
+    Redirect& operator=(Redirect&&) = default;
+};
+
+constexpr int SPAWN_EREDIR = -1;
+constexpr int SPAWN_FORK = -2;   // запускать через fork_exec
+
+static pid_t fork_exec(const char* file, char* const argv[],
+                       const pmr::vector<Redirect>& redirs, pid_t pgid) {
+    pid_t pid = fork();
+    if (pid > 0 && pgid >= 0) setpgid(pid, pgid ? pgid : pid);
+    if (pid != 0) return pid;
+
+    if (pgid >= 0) setpgid(0, pgid);
+
+    for (auto& r : redirs) {
+        if (r.path.empty()) {
+            if (dup2(r.src_fd, r.fd) < 0) _exit(126);
+            continue;
+        }
+        int fd = open(r.path.c_str(), r.flags, 0644);
+        if (fd < 0) {
+            perror(r.path.c_str());
+            _exit(1);
+        }
+        if (fd != r.fd) {
+            dup2(fd, r.fd);
+            close(fd);
+        }
+    }
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, nullptr);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+
+    execvp(file, argv);
+    int e = errno;
+    perror(argv[0]);
+    _exit(e == ENOENT ? 127 : 126);
+}
+
+// Обычные файлы и устройства (/dev/null, терминал) перенаправлений
+// открываются в шелле до posix_spawn и отдаются потомку через dup2:
+// ошибку addopen posix_spawn вернул бы как ошибку запуска, и её нельзя
+// было бы отличить от отсутствующей программы. FIFO и сокеты открывает
+// сам потомок, и запуск уходит на fork: open FIFO ждёт второй стороны
+// сколько угодно, а posix_spawn (CLONE_VFORK) держит шелл, пока потомок
+// не дойдёт до exec, — цикл событий встал бы вместе с ним. Открытие
+// с O_NONBLOCK не ждёт и тогда, когда файл подменили между stat и open.
+static int posix_spawn_exec(pid_t& pid, const char* file, char* const argv[],
+                            const pmr::vector<Redirect>& redirs, pid_t pgid) {
+    pmr::vector<int> opened(redirs.get_allocator().resource());
+    auto close_opened = [&] {
+        for (int fd : opened) close(fd);
+    };
 
-        if (p.size() >= 7) {
-            string shell = p[6];
-            if (shell.size() >= 2 &&
-                shell.substr(shell.size() - 2) == "sh") {
-                UserInfo u;
-                u.username = p[0];
-                u.uid = p[2];
-                u.gid = p[3];
-                u.home = p[5];
-                u.shell = shell;
-                users.push_back(u);
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    for (auto& r : redirs) {
+        if (r.path.empty()) {
+            posix_spawn_file_actions_adddup2(&fa, r.src_fd, r.fd);
+            continue;
+        }
+        struct stat st;
+        int fd = -1;
+        auto direct = [](const struct stat& st) {
+            return S_ISREG(st.st_mode) || S_ISCHR(st.st_mode);
+        };
+        if (stat(r.path.c_str(), &st) != 0 || direct(st)) {
+            fd = open(r.path.c_str(), r.flags | O_NONBLOCK | O_NOCTTY | O_CLOEXEC,
+                      0644);
+            if (fd < 0 && errno != ENXIO) {
+                perror(r.path.c_str());
+                close_opened();
+                posix_spawn_file_actions_destroy(&fa);
+                return SPAWN_EREDIR;
+            }
+            if (fd >= 0 && (fstat(fd, &st) != 0 || !direct(st))) {
+                close(fd);
+                fd = -1;
             }
         }
+        if (fd < 0) {
+            close_opened();
+            posix_spawn_file_actions_destroy(&fa);
+            return SPAWN_FORK;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        opened.push_back(fd);
+        posix_spawn_file_actions_adddup2(&fa, fd, r.fd);
     }
-    return users;
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+
+    // Шелл игнорирует SIGPIPE (в него пишут потоки встроенных команд),
+    // а игнорирование наследуется через exec — потомкам возвращаем SIG_DFL.
+    sigset_t empty, defaults;
+    sigemptyset(&empty);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    int rc = posix_spawn(&pid, file, &fa, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    close_opened();
+    return rc;
 }
 
-bool create_users_directory() {
-    char* home = getenv("HOME");
-    if (!home) {
-        cerr << "ERROR: HOME environment variable not set!" << endl;
-        return false;
+// file — уже разрешённый путь к программе (см. lookup_command).
+// pgid: -1 — группа шелла, 0 — новая группа, >0 — присоединиться к pgid.
+// Возвращает pid потомка или -1, код ошибки — в err. err == SPAWN_EREDIR:
+// не открылся файл перенаправления, ошибка уже выведена с его путём.
+pid_t spawn_process(const char* file, char* const argv[],
+                    const pmr::vector<Redirect>& redirs, int& err,
+                    pid_t pgid = -1) {
+    err = 0;
+    // Буфер cout должен уйти до того, как потомок начнёт писать в тот же fd
+    cout.flush();
+
+    if (spawn_backend == SpawnBackend::Spawn) {
+        pid_t pid;
+        int rc = posix_spawn_exec(pid, file, argv, redirs, pgid);
+        if (rc == 0) return pid;
+        if (rc == SPAWN_EREDIR) {
+            err = rc;
+            return -1;
+        }
+        // ENOEXEC: скрипт без #!, его умеет запускать только execvp через sh.
+        // ENOSYS/EINVAL: posix_spawn недоступен — уходим на fork.
+        if (rc != ENOEXEC && rc != ENOSYS && rc != EINVAL &&
+            rc != SPAWN_FORK) {
+            err = rc;
+            return -1;
+        }
     }
-   
-    users_dir = string(home) + "/users";
-   
+
+    pid_t pid = fork_exec(file, argv, redirs, pgid);
+    if (pid < 0) err = errno;
+    return pid;
+}
+
+// ================= Хеш команд =================
+
+// Аналог hash из bash: имя команды -> полный путь, включая отрицательные
+// записи для ненайденных команд. Запись из каталога k сбрасывается, когда
+// меняется mtime любого из каталогов PATH с индексом <= k: там могла
+// появиться команда с тем же именем или исчезнуть найденная.
+
+struct PathDir {
+    string path;
+    timespec mtime;
+};
+
+struct HashEntry {
+    string path;        // пусто — команда не найдена
+    size_t dir_index;   // для отрицательных записей равен dirs.size()
+    unsigned long hits;
+};
+
+struct CommandHash {
+    string path_env;
+    vector<PathDir> dirs;
+    unordered_map<string, HashEntry> table;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    unsigned long negative_hits = 0;
+    unsigned long epoch = 0;   // растёт, когда записи удаляются из table
+};
+
+CommandHash command_hash;
+
+static timespec dir_mtime(const string& dir) {
     struct stat st;
-    if (stat(users_dir.c_str(), &st) == 0) {
-        return S_ISDIR(st.st_mode);
-    }
-   
-    if (mkdir(users_dir.c_str(), 0755) != 0) {
-        perror(("Failed to create directory " + users_dir).c_str());
-        return false;
+    if (stat(dir.c_str(), &st) != 0) return timespec{0, 0};
+    return st.st_mtim;
+}
+
+void rehash_commands() {
+    command_hash.table.clear();
+    command_hash.dirs.clear();
+    ++command_hash.epoch;
+
+    const char* p = getenv("PATH");
+    command_hash.path_env = p ? p : "";
+
+    stringstream ss(command_hash.path_env);
+    string dir;
+    while (getline(ss, dir, ':')) {
+        if (dir.empty()) dir = ".";
+        command_hash.dirs.push_back({dir, dir_mtime(dir)});
     }
-    return true;
 }
 
-void add_user(const string& name) {
-    struct passwd* pw = getpwnam(name.c_str());
-    if (pw != nullptr) {
-        return;
+// Сбрасывает записи, зависящие от каталогов с изменившимся mtime.
+// Новые mtime запоминаются у всех проверенных каталогов сразу, а таблица
+// обходится один раз, от первого изменившегося: иначе каждый следующий
+// изменившийся каталог стоил бы ещё одного обхода при следующем поиске.
+static void revalidate_dirs(size_t upto) {
+    auto& dirs = command_hash.dirs;
+    size_t first = SIZE_MAX;
+    for (size_t i = 0; i <= upto && i < dirs.size(); ++i) {
+        timespec now = dir_mtime(dirs[i].path);
+        if (now.tv_sec == dirs[i].mtime.tv_sec &&
+            now.tv_nsec == dirs[i].mtime.tv_nsec)
+            continue;
+        dirs[i].mtime = now;
+        first = min(first, i);
+    }
+    if (first == SIZE_MAX) return;
+
+    ++command_hash.epoch;
+    for (auto it = command_hash.table.begin(); it != command_hash.table.end();) {
+        if (it->second.dir_index >= first)
+            it = command_hash.table.erase(it);
+        else
+            ++it;
     }
-  
-    string cmd = "adduser --disabled-password --gecos '' " + name + " 2>&1";
-    system(cmd.c_str());
 }
 
-void del_user(const string& name) {
-    string cmd = "userdel " + name + " 2>&1";
-    system(cmd.c_str());
+static bool is_executable_file(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+           access(path.c_str(), X_OK) == 0;
 }
 
-void sync_vfs_with_passwd() {
-    vector<UserInfo> sys_users = get_system_users();
-    vector<string> vfs_dirs;
+// Возвращает полный путь к команде или пустую строку.
+// Имена со слешем в хеш не попадают; для остальных в *found — запись хеша.
+const string& lookup_command(string_view name, HashEntry** found = nullptr) {
+    static string direct;
+    if (name.find('/') != string::npos) {
+        direct.assign(name);
+        return direct;
+    }
+    // Ключ хеша — string; буфер переиспользуется между вызовами
+    thread_local string key;
+    key.assign(name);
+
+    const char* p = getenv("PATH");
+    if (command_hash.path_env != (p ? p : "") ||
+        (command_hash.dirs.empty() && command_hash.table.empty()))
+        rehash_commands();
+
+    auto it = command_hash.table.find(key);
+    if (it != command_hash.table.end()) {
+        revalidate_dirs(it->second.dir_index);
+        it = command_hash.table.find(key);
+    }
+    if (it != command_hash.table.end()) {
+        ++it->second.hits;
+        if (it->second.path.empty())
+            ++command_hash.negative_hits;
+        else
+            ++command_hash.hits;
+        if (found) *found = &it->second;
+        return it->second.path;
+    }
 
-    DIR* dir = opendir(users_dir.c_str());
-    if (dir) {
-        dirent* e;
-        while ((e = readdir(dir))) {
-            string n = e->d_name;
-            if (n != "." && n != "..") vfs_dirs.push_back(n);
+    ++command_hash.misses;
+    auto& dirs = command_hash.dirs;
+    HashEntry entry{"", dirs.size(), 1};
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        string candidate = dirs[i].path + "/" + key;
+        if (is_executable_file(candidate)) {
+            entry.path = candidate;
+            entry.dir_index = i;
+            break;
         }
-        closedir(dir);
     }
+    HashEntry& added = command_hash.table.emplace(key, entry).first->second;
+    if (found) *found = &added;
+    return added.path;
+}
 
-    for (auto& d : vfs_dirs) {
-        bool found = false;
-        for (auto& u : sys_users) {
-            if (u.username == d) {
-                found = true;
-                break;
+// Поиск, запомненный вне хеша (в стадии кешированной строки). Запись
+// хеша живёт, пока не сменилась эпоха; PATH и mtime каталогов до
+// найденного проверяются как в lookup_command, но без поиска по имени.
+struct ResolvedCommand {
+    HashEntry* entry = nullptr;
+    unsigned long epoch = 0;
+};
+
+const string& lookup_command_cached(string_view name, ResolvedCommand& rc) {
+    if (rc.entry && rc.epoch == command_hash.epoch) {
+        const char* p = getenv("PATH");
+        if (command_hash.path_env == (p ? p : "")) {
+            revalidate_dirs(rc.entry->dir_index);
+            if (rc.epoch == command_hash.epoch) {
+                ++rc.entry->hits;
+                if (rc.entry->path.empty())
+                    ++command_hash.negative_hits;
+                else
+                    ++command_hash.hits;
+                return rc.entry->path;
             }
         }
-        if (!found) {
-            add_user(d);
-        }
     }
+    rc.entry = nullptr;
+    const string& path = lookup_command(name, &rc.entry);
+    rc.epoch = command_hash.epoch;
+    return path;
+}
 
-    sys_users = get_system_users();
+// ================= Цикл событий =================
 
-    for (auto& u : sys_users) {
-        string ud = users_dir + "/" + u.username;
-        mkdir(ud.c_str(), 0755);
-        ofstream(ud + "/id") << u.uid;
-        ofstream(ud + "/home") << u.home;
-        ofstream(ud + "/shell") << u.shell;
-    }
+// Один epoll на весь шелл: stdin, signalfd, источник изменений VFS и pidfd
+// потомков. Все обработчики выполняются в основном потоке.
 
-    for (auto& u : sys_users) {
-        bool found = false;
-        for (auto& d : vfs_dirs) {
-            if (d == u.username) {
-                found = true;
-                break;
-            }
-        }
-        if (!found) {
-            del_user(u.username);
-        }
+using EventHandler = function<void(uint32_t)>;
+
+int epoll_fd = -1;
+vector<EventHandler> event_handlers;   // по номеру fd
+int reactor_input_fd = -1;   // не читается, пока ждём передний план
+int foreground_depth = 0;
+
+bool reactor_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return false;
     }
+    return true;
+}
 
-    users_list = sys_users;
+bool reactor_add(int fd, uint32_t events, EventHandler handler) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) return false;
+    if (static_cast<size_t>(fd) >= event_handlers.size())
+        event_handlers.resize(fd + 1);
+    event_handlers[fd] = move(handler);
+    return true;
 }
 
-void vfs_monitor_loop() {
-    while (running) {
-        sync_vfs_with_passwd();
-        sleep(1);
+void reactor_remove(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    if (static_cast<size_t>(fd) < event_handlers.size())
+        event_handlers[fd] = nullptr;
+}
+
+void reactor_run_once(int timeout_ms) {
+    epoll_event events[32];
+    int n = epoll_wait(epoll_fd, events, 32, timeout_ms);
+    for (int i = 0; i < n; ++i) {
+        size_t fd = events[i].data.fd;
+        if (fd >= event_handlers.size() || !event_handlers[fd]) continue;
+        // Копия: обработчик может снять с регистрации сам себя
+        EventHandler handler = event_handlers[fd];
+        handler(events[i].events);
     }
 }
 
-// ================= main =================
+// Крутит цикл, пока done() не вернёт true. Ввод на это время снимается
+// с epoll целиком (маска 0 не спасает от EPOLLHUP закрытого канала):
+// строки, набранные во время работы команды, прочитаются после неё.
+void reactor_run_until(const function<bool()>& done) {
+    if (foreground_depth++ == 0 && reactor_input_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, reactor_input_fd, nullptr);
 
-int main() {
-    setup_signal_handlers();
-   
-    load_history();
-   
-    if (!create_users_directory()) {
-        cerr << "Failed to create users directory" << endl;
-        return 1;
+    while (!done()) reactor_run_once(-1);
+
+    if (--foreground_depth == 0 && reactor_input_fd >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = reactor_input_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor_input_fd, &ev);
     }
+}
+
+static int decode_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 0;
+}
+
+static int pidfd_open(pid_t pid) {
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+// Ждёт потомков переднего плана через их pidfd, продолжая обслуживать
+// сигналы и VFS. pids[i] < 0 пропускается, коды — в status[i].
+// Обработчик pidfd захватывает только указатель на состояние ожидания и
+// индекс: такая лямбда помещается в буфер std::function без выделения.
+struct ChildWait {
+    const pmr::vector<pid_t>& pids;
+    pmr::vector<int>& status;
+    pmr::vector<int> pidfds;
+    size_t remaining = 0;
+};
+
+void wait_children(const pmr::vector<pid_t>& pids, pmr::vector<int>& status) {
+    pmr::memory_resource* mem = pids.get_allocator().resource();
+    ChildWait w{pids, status, pmr::vector<int>(pids.size(), -1, mem)};
+    pmr::vector<size_t> blocking(mem);
+
+    for (size_t i = 0; i < pids.size(); ++i) {
+        if (pids[i] < 0) continue;
+        int fd = pidfd_open(pids[i]);
+        if (fd < 0) {
+            // Ядро без pidfd: ждём по-старому после остальных
+            blocking.push_back(i);
+            continue;
+        }
+        w.pidfds[i] = fd;
+        ++w.remaining;
+        ChildWait* wp = &w;
+        reactor_add(fd, EPOLLIN, [wp, i](uint32_t) {
+            int st;
+            if (waitpid(wp->pids[i], &st, WNOHANG) <= 0) return;
+            wp->status[i] = decode_status(st);
+            reactor_remove(wp->pidfds[i]);
+            close(wp->pidfds[i]);
+            --wp->remaining;
+        });
+    }
+
+    reactor_run_until([&w] { return w.remaining == 0; });
+
+    for (size_t i : blocking) {
+        int st;
+        waitpid(pids[i], &st, 0);
+        status[i] = decode_status(st);
+    }
+}
+
+// ================= Задания =================
+
+// Фоновые задания (cmd &). Потомков заданий собирает цикл событий: каждый
+// pid зарегистрирован в epoll через pidfd, а SIGCHLD из signalfd дополнительно
+// сообщает об остановке и продолжении. wait4 делается только по pid из
+// таблицы, поэтому ожидание команд переднего плана не затрагивается.
+// Мьютекс нужен потоку встроенной команды jobs в конвейере.
+
+enum class JobState { Running, Stopped, Done };
+
+struct Job {
+    int id;
+    pid_t pgid;
+    string command;
+    vector<pid_t> pids;
+    vector<int> pidfds;      // -1, если pidfd недоступен или уже закрыт
+    vector<int> status;      // код завершения каждой стадии
+    vector<bool> finished;
+    JobState state = JobState::Running;
+    struct rusage usage{};   // суммарно по всем стадиям
+    chrono::steady_clock::time_point started;
+    chrono::steady_clock::duration elapsed{};
+};
+
+mutex jobs_mutex;
+vector<Job> jobs;
+int next_job_id = 1;
+
+static void add_rusage(struct rusage& to, const struct rusage& ru) {
+    timeradd(&to.ru_utime, &ru.ru_utime, &to.ru_utime);
+    timeradd(&to.ru_stime, &ru.ru_stime, &to.ru_stime);
+    to.ru_maxrss = max(to.ru_maxrss, ru.ru_maxrss);
+    to.ru_minflt += ru.ru_minflt;
+    to.ru_majflt += ru.ru_majflt;
+    to.ru_nvcsw += ru.ru_nvcsw;
+    to.ru_nivcsw += ru.ru_nivcsw;
+}
+
+// Опрашивает потомков всех заданий без блокировки.
+void reap_jobs() {
+    lock_guard<mutex> lock(jobs_mutex);
+    for (auto& job : jobs) {
+        if (job.state == JobState::Done) continue;
+
+        for (size_t i = 0; i < job.pids.size(); ++i) {
+            if (job.finished[i]) continue;
+
+            int st;
+            struct rusage ru;
+            pid_t rc = wait4(job.pids[i], &st,
+                             WNOHANG | WUNTRACED | WCONTINUED, &ru);
+            if (rc < 0 && errno == ECHILD) {
+                job.finished[i] = true;
+            } else if (rc <= 0) {
+                continue;
+            } else if (WIFSTOPPED(st)) {
+                job.state = JobState::Stopped;
+            } else if (WIFCONTINUED(st)) {
+                job.state = JobState::Running;
+            } else {
+                job.finished[i] = true;
+                job.status[i] = decode_status(st);
+                add_rusage(job.usage, ru);
+            }
+
+            if (job.finished[i] && job.pidfds[i] >= 0) {
+                reactor_remove(job.pidfds[i]);
+                close(job.pidfds[i]);
+                job.pidfds[i] = -1;
+            }
+        }
+
+        if (all_of(job.finished.begin(), job.finished.end(),
+                   [](bool f) { return f; })) {
+            job.state = JobState::Done;
+            job.elapsed = chrono::steady_clock::now() - job.started;
+        }
+    }
+}
+
+// Регистрирует запущенный конвейер как задание и печатает "[id] pid".
+void add_job(pid_t pgid, vector<pid_t> pids, const string& command) {
+    int id;
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        Job job;
+        job.id = id = next_job_id++;
+        job.pgid = pgid;
+        job.command = command;
+        job.status.assign(pids.size(), 0);
+        job.finished.assign(pids.size(), false);
+        for (pid_t pid : pids) {
+            int fd = pidfd_open(pid);
+            if (fd >= 0) reactor_add(fd, EPOLLIN, [](uint32_t) { reap_jobs(); });
+            job.pidfds.push_back(fd);
+        }
+        job.pids = move(pids);
+        job.started = chrono::steady_clock::now();
+        jobs.push_back(move(job));
+    }
+    cout << "[" << id << "] " << pgid << endl;
+}
+
+static const char* job_state_name(const Job& job) {
+    switch (job.state) {
+    case JobState::Running: return "Running";
+    case JobState::Stopped: return "Stopped";
+    case JobState::Done: break;
+    }
+    int code = job.status.empty() ? 0 : job.status.back();
+    return code == 0 ? "Done" : "Exit";
+}
+
+static void print_job(ostream& out, const Job& job, bool details) {
+    out << "[" << job.id << "]  " << job_state_name(job);
+    if (job.state == JobState::Done && job.status.back() != 0)
+        out << " " << job.status.back();
+    out << "\t" << job.command << endl;
+    if (!details) return;
+
+    out << "      pids:";
+    for (size_t i = 0; i < job.pids.size(); ++i) {
+        out << " " << job.pids[i];
+        if (job.finished[i]) out << "(" << job.status[i] << ")";
+    }
+    out << endl;
+    if (job.state == JobState::Done) {
+        auto ms = [](const timeval& tv) {
+            return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+        };
+        out << "      real " << chrono::duration<double, milli>(job.elapsed).count()
+            << " ms, user " << ms(job.usage.ru_utime)
+            << " ms, sys " << ms(job.usage.ru_stime)
+            << " ms, maxrss " << job.usage.ru_maxrss << " KiB" << endl;
+    }
+}
+
+// Перед приглашением сообщает о завершённых заданиях и убирает их из таблицы.
+void notify_jobs() {
+    lock_guard<mutex> lock(jobs_mutex);
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (it->state != JobState::Done) {
+            ++it;
+            continue;
+        }
+        print_job(cout, *it, false);
+        it = jobs.erase(it);
+    }
+    if (jobs.empty()) next_job_id = 1;
+}
+
+void builtin_jobs(const Args& args, ostream& out) {
+    bool details = args.size() > 1 && args[1] == "-l";
+    lock_guard<mutex> lock(jobs_mutex);
+    for (auto& job : jobs) print_job(out, job, details);
+}
+
+// %N, N или пусто (последнее задание). Вызывать под jobs_mutex.
+static Job* find_job_locked(const Args& args) {
+    if (jobs.empty()) return nullptr;
+    if (args.size() < 2) return &jobs.back();
+
+    string spec(args[1]);
+    if (!spec.empty() && spec[0] == '%') spec = spec.substr(1);
+    int id = atoi(spec.c_str());
+    for (auto& job : jobs)
+        if (job.id == id) return &job;
+    return nullptr;
+}
+
+static bool job_left_running(int id) {
+    lock_guard<mutex> lock(jobs_mutex);
+    auto it = find_if(jobs.begin(), jobs.end(),
+                      [id](const Job& j) { return j.id == id; });
+    return it == jobs.end() || it->state != JobState::Running;
+}
+
+// fg: продолжить задание и ждать его на переднем плане.
+void builtin_fg(const Args& args) {
+    int id;
+    pid_t pgid;
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        Job* job = find_job_locked(args);
+        if (!job) {
+            cout << "fg: no such job" << endl;
+            return;
+        }
+        id = job->id;
+        pgid = job->pgid;
+        cout << job->command << endl;
+
+        if (job->state == JobState::Stopped) {
+            job->state = JobState::Running;
+            kill(-pgid, SIGCONT);
+        }
+    }
+
+    bool tty = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    if (tty) tcsetpgrp(STDIN_FILENO, pgid);
+    reactor_run_until([id] { return job_left_running(id); });
+    if (tty) tcsetpgrp(STDIN_FILENO, getpgrp());
+
+    lock_guard<mutex> lock(jobs_mutex);
+    auto it = find_if(jobs.begin(), jobs.end(),
+                      [id](const Job& j) { return j.id == id; });
+    if (it == jobs.end()) return;
+    if (it->state == JobState::Stopped) {
+        cout << endl;
+        print_job(cout, *it, false);
+        return;
+    }
+    pipe_status = it->status;
+    jobs.erase(it);
+}
+
+void builtin_bg(const Args& args) {
+    lock_guard<mutex> lock(jobs_mutex);
+    Job* job = find_job_locked(args);
+    if (!job) {
+        cout << "bg: no such job" << endl;
+        return;
+    }
+    if (job->state == JobState::Stopped) {
+        job->state = JobState::Running;
+        kill(-job->pgid, SIGCONT);
+    }
+    cout << "[" << job->id << "] " << job->command << " &" << endl;
+}
+
+// wait без аргументов ждёт все задания, wait %N — одно.
+void builtin_wait(const Args& args) {
+    if (args.size() < 2) {
+        reactor_run_until([] {
+            lock_guard<mutex> lock(jobs_mutex);
+            return none_of(jobs.begin(), jobs.end(), [](const Job& j) {
+                return j.state == JobState::Running;
+            });
+        });
+        return;
+    }
+
+    int id;
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        Job* job = find_job_locked(args);
+        if (!job) {
+            cout << "wait: no such job" << endl;
+            return;
+        }
+        id = job->id;
+    }
+    reactor_run_until([id] { return job_left_running(id); });
+
+    lock_guard<mutex> lock(jobs_mutex);
+    auto it = find_if(jobs.begin(), jobs.end(),
+                      [id](const Job& j) { return j.id == id; });
+    if (it != jobs.end() && it->state == JobState::Done)
+        pipe_status = it->status;
+}
+
+// ================= Вывод в дескриптор =================
+
+// streambuf поверх fd: встроенная команда пишет прямо в канал конвейера
+// или в файл перенаправления, минуя cout.
+class FdOutBuf : public streambuf {
+public:
+    explicit FdOutBuf(int fd) : fd_(fd) { setp(buf_, buf_ + sizeof(buf_)); }
+    ~FdOutBuf() override { sync(); }
+
+protected:
+    int overflow(int ch) override {
+        if (sync() != 0) return traits_type::eof();
+        if (ch != traits_type::eof()) {
+            *pptr() = static_cast<char>(ch);
+            pbump(1);
+        }
+        return ch == traits_type::eof() ? 0 : ch;
+    }
+
+    int sync() override {
+        const char* p = pbase();
+        while (p < pptr()) {
+            ssize_t n = write(fd_, p, pptr() - p);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // Читатель ушёл (EPIPE) — остаток выбрасываем
+                setp(buf_, buf_ + sizeof(buf_));
+                return -1;
+            }
+            p += n;
+        }
+        setp(buf_, buf_ + sizeof(buf_));
+        return 0;
+    }
+
+private:
+    int fd_;
+    char buf_[4096];
+};
+
+// ================= Встроенные команды =================
+
+void builtin_echo(const Args& args, ostream& out) {
+    // Кавычки уже сняты лексером
+    for (size_t i = 1; i < args.size(); ++i) {
+        out << args[i];
+        if (i + 1 < args.size()) out << " ";
+    }
+    out << endl;
+}
+
+void builtin_env(const Args& args, ostream& out) {
+    if (args.size() < 2) {
+        out << "Usage: \\e $VARIABLE" << endl;
+        return;
+    }
+   
+    string var(args[1]);
+    if (!var.empty() && var[0] == '$') {
+        var = var.substr(1);
+    }
+   
+    const char* val = getenv(var.c_str());
+    if (!val) {
+        out << "Variable $" << var << " not found" << endl;
+        return;
+    }
+
+    string v(val);
+    if (v.find(':') != string::npos) {
+        stringstream ss(v);
+        string part;
+        while (getline(ss, part, ':'))
+            out << part << endl;
+    } else {
+        out << v << endl;
+    }
+}
+
+// Поиск по PATH мимо хеша команд: \\l выполняется и в потоке стадии
+// конвейера, а command_hash меняет только основной поток.
+static string find_in_path(const string& name) {
+    const char* p = getenv("PATH");
+    stringstream ss(p ? p : "");
+    string dir;
+    while (getline(ss, dir, ':')) {
+        string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        if (is_executable_file(candidate)) return candidate;
+    }
+    return "";
+}
+
+// Вывод lsblk/fdisk направляется в out_fd, чтобы \\l работал в конвейере.
+static int run_to_fd(vector<string> argv, int out_fd) {
+    string file = find_in_path(argv[0]);
+    if (file.empty()) return 127;
+
+    vector<char*> c_args;
+    for (auto& a : argv)
+        c_args.push_back(const_cast<char*>(a.c_str()));
+    c_args.push_back(nullptr);
+
+    pmr::vector<Redirect> redirs = {
+        {STDOUT_FILENO, "", 0, out_fd},
+        {STDERR_FILENO, "/dev/null", O_WRONLY, -1},
+    };
+    int err;
+    pid_t pid = spawn_process(file.c_str(), c_args.data(), redirs, err);
+    if (pid < 0) return 127;
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+void builtin_disk_info(const Args& args, ostream& out, int out_fd) {
+    if (args.size() < 2) {
+        out << "Usage: \\l /dev/device" << endl;
+        out << "Example: \\l /dev/sda" << endl;
+        return;
+    }
+   
+    out.flush();
+    string device(args[1]);
+    if (run_to_fd({"lsblk", device}, out_fd) != 0)
+        run_to_fd({"fdisk", "-l", device}, out_fd);
+}
+
+void builtin_hash(const Args& args, ostream& out) {
+    if (args[0] == "\\rehash" || (args.size() > 1 && args[1] == "-r")) {
+        rehash_commands();
+        return;
+    }
+
+    if (command_hash.table.empty()) {
+        out << "hash: hash table empty" << endl;
+    } else {
+        out << "hits\tcommand" << endl;
+        for (auto& [name, e] : command_hash.table) {
+            out << e.hits << "\t"
+                 << (e.path.empty() ? name + " (not found)" : e.path) << endl;
+        }
+    }
+    out << "lookups: " << command_hash.hits + command_hash.negative_hits +
+                               command_hash.misses
+         << ", hits: " << command_hash.hits
+         << ", negative hits: " << command_hash.negative_hits
+         << ", misses: " << command_hash.misses << endl;
+}
+
+// \arena — память последней строки: сколько взято из арены, пик за
+// сессию, и сколько выделений в куче сделал основной поток.
+void builtin_arena(ostream& out) {
+    out << "arena: last line " << arena_usage.last_used
+        << " bytes, high water " << arena_usage.high_water
+        << " bytes, capacity " << arena_usage.capacity
+        << " bytes, block allocations " << arena_usage.block_allocs << endl;
+    out << "heap: last line " << arena_stats.last_heap_allocs
+        << " allocations, lines without heap allocations "
+        << arena_stats.heap_free_commands << "/" << arena_stats.commands
+        << ", total allocations "
+        << heap_allocations.load(memory_order_relaxed) << endl;
+}
+
+// \users [--name N] [--prefix P] [--uid A[-B]] [--shell S] [-c]
+// Запрос к снимку пользователей в памяти, без fork и чтения ~/users.
+// Ведущий индекс выбирается по самому узкому условию: имя и точный uid —
+// хеш, префикс — отсортированные имена, диапазон uid — отсортированные
+// uid; остальные условия проверяются на найденных записях.
+void builtin_users(const Args& args, ostream& out) {
+    string name, prefix, shell;
+    long uid_lo = LONG_MIN, uid_hi = LONG_MAX;
+    bool by_uid = false, count_only = false;
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        const pmr::string& a = args[i];
+        bool has_value = i + 1 < args.size();
+        if (a == "-c" || a == "--count") {
+            count_only = true;
+        } else if (a == "--name" && has_value) {
+            name = args[++i];
+        } else if (a == "--prefix" && has_value) {
+            prefix = args[++i];
+        } else if (a == "--shell" && has_value) {
+            shell = args[++i];
+        } else if (a == "--uid" && has_value) {
+            const pmr::string& r = args[++i];
+            char* end;
+            uid_lo = uid_hi = strtol(r.c_str(), &end, 10);
+            if (*end == '-') uid_hi = strtol(end + 1, &end, 10);
+            if (*end != '\0' || end == r.c_str() || uid_lo > uid_hi) {
+                out << "\\users: bad uid range '" << r << "'" << endl;
+                return;
+            }
+            by_uid = true;
+        } else {
+            out << "Usage: \\users [--name N] [--prefix P] [--uid A[-B]]"
+                   " [--shell S] [-c]" << endl;
+            return;
+        }
+    }
+
+    auto snapshot = users_snapshot();
+    if (!snapshot) {
+        out << "\\users: user table not loaded yet" << endl;
+        return;
+    }
+    const UserSnapshot& s = *snapshot;
+
+    auto matches = [&](size_t i) {
+        const UserInfo& u = s.users[i];
+        return (name.empty() || u.username == name) &&
+               (prefix.empty() || u.username.compare(0, prefix.size(), prefix) == 0) &&
+               (!by_uid || (s.uids[i] >= uid_lo && s.uids[i] <= uid_hi)) &&
+               (shell.empty() || u.shell == shell);
+    };
+
+    vector<size_t> found;
+    auto consider = [&](size_t i) {
+        if (matches(i)) found.push_back(i);
+    };
+
+    if (!name.empty()) {
+        auto it = s.by_name.find(name);
+        if (it != s.by_name.end()) consider(it->second);
+    } else if (by_uid && uid_lo == uid_hi) {
+        auto range = s.by_uid.equal_range(uid_lo);
+        for (auto it = range.first; it != range.second; ++it) consider(it->second);
+    } else if (!prefix.empty()) {
+        auto it = lower_bound(s.name_order.begin(), s.name_order.end(), prefix,
+                              [&s](size_t i, const string& p) {
+                                  return s.users[i].username < p;
+                              });
+        for (; it != s.name_order.end() &&
+               s.users[*it].username.compare(0, prefix.size(), prefix) == 0;
+             ++it)
+            consider(*it);
+    } else if (by_uid) {
+        auto it = lower_bound(s.uid_order.begin(), s.uid_order.end(), uid_lo,
+                              [&s](size_t i, long v) { return s.uids[i] < v; });
+        for (; it != s.uid_order.end() && s.uids[*it] <= uid_hi; ++it)
+            consider(*it);
+    } else {
+        for (size_t i : s.name_order) consider(i);
+    }
+
+    if (count_only) {
+        out << found.size() << endl;
+        return;
+    }
+    for (size_t i : found) {
+        const UserInfo& u = s.users[i];
+        out << u.username << "\t" << u.uid << "\t" << u.gid << "\t" << u.home
+            << "\t" << u.shell << "\n";
+    }
+}
+
+bool is_builtin(string_view name) {
+    return name == "echo" || name == "\\e" || name == "\\l" ||
+           name == "\\pipestatus" || name == "\\hash" || name == "\\rehash" ||
+           name == "jobs" || name == "\\vfsstat" || name == "\\adduser" ||
+           name == "\\deluser" || name == "\\users" || name == "\\arena" ||
+           name == "\\parsecache";
+}
+
+// Выполняет встроенную команду, вывод — в out (out_fd — его дескриптор).
+void run_builtin(const Args& args, ostream& out, int out_fd) {
+    if (args[0] == "echo") {
+        builtin_echo(args, out);
+    } else if (args[0] == "\\e") {
+        builtin_env(args, out);
+    } else if (args[0] == "\\l") {
+        builtin_disk_info(args, out, out_fd);
+    } else if (args[0] == "\\pipestatus") {
+        for (size_t i = 0; i < pipe_status.size(); ++i)
+            out << (i ? " " : "") << pipe_status[i];
+        out << endl;
+    } else if (args[0] == "\\hash" || args[0] == "\\rehash") {
+        builtin_hash(args, out);
+    } else if (args[0] == "jobs") {
+        builtin_jobs(args, out);
+    } else if (args[0] == "\\vfsstat") {
+        builtin_vfsstat(out);
+    } else if (args[0] == "\\adduser" || args[0] == "\\deluser") {
+        builtin_account_batch(args, out);
+    } else if (args[0] == "\\users") {
+        builtin_users(args, out);
+    } else if (args[0] == "\\arena") {
+        builtin_arena(out);
+    } else if (args[0] == "\\parsecache") {
+        builtin_parsecache(out);
+    }
+    out.flush();
+}
+
+// ================= Конвейеры =================
+
+// Стадии, слова и перенаправления выделяются из ресурса конвейера
+// (пул кеша разобранных строк).
+struct Stage {
+    Args args;
+    pmr::vector<Redirect> redirs;
+    mutable ResolvedCommand resolved;   // программа, найденная при запуске
+
+    explicit Stage(pmr::memory_resource* mem) : args(mem), redirs(mem) {}
+};
+
+struct Pipeline {
+    pmr::vector<Stage> stages;
+    int pipe_size = -1;     // -1 — default_pipe_size, 0 — размер ядра (64 KiB)
+    bool expands = false;   // раскрывалась ~: зависит от HOME и пользователей
+
+    explicit Pipeline(pmr::memory_resource* mem) : stages(mem) {}
+};
+
+// Разбирает токены на стадии по "|" и вытаскивает перенаправления <, >, >>.
+// ~ раскрывается только в словах без кавычек.
+bool parse_pipeline(const Token* tokens, size_t count, Pipeline& pl,
+                    string& error) {
+    pmr::memory_resource* mem = pl.stages.get_allocator().resource();
+    auto word = [mem, &pl](const Token& t) {
+        pmr::string w(t.text, mem);
+        if (!t.quoted && !w.empty() && w[0] == '~') {
+            pl.expands = true;
+            expand_tilde(w);
+        }
+        return w;
+    };
+
+    pl.stages.emplace_back(mem);
+    for (size_t i = 0; i < count; ++i) {
+        const Token& t = tokens[i];
+        Stage& st = pl.stages.back();
+
+        if (t.kind == TokKind::Pipe) {
+            if (st.args.empty()) {
+                error = "syntax error near unexpected token `|'";
+                return false;
+            }
+            pl.stages.emplace_back(mem);
+            continue;
+        }
+        if (t.kind == TokKind::In || t.kind == TokKind::Out ||
+            t.kind == TokKind::Append) {
+            if (i + 1 >= count || tokens[i + 1].kind != TokKind::Word) {
+                error = "syntax error: missing file after `" + string(t.text) + "'";
+                return false;
+            }
+            pmr::string path = word(tokens[++i]);
+            if (t.kind == TokKind::In) {
+                st.redirs.emplace_back(STDIN_FILENO, path, O_RDONLY, -1);
+            } else {
+                int flags = O_WRONLY | O_CREAT |
+                            (t.kind == TokKind::Append ? O_APPEND : O_TRUNC);
+                st.redirs.emplace_back(STDOUT_FILENO, path, flags, -1);
+            }
+            continue;
+        }
+        if (t.kind != TokKind::Word) {
+            error = "syntax error near unexpected token `" + string(t.text) + "'";
+            return false;
+        }
+        st.args.push_back(word(t));
+    }
+
+    if (pl.stages.back().args.empty()) {
+        if (pl.stages.size() > 1) {
+            error = "syntax error: pipeline ends with `|'";
+            return false;
+        }
+        pl.stages.clear();
+    }
+    return true;
+}
+
+// Дескриптор вывода для встроенной стадии: файл из > / >> или копия
+// default_fd. Владеет им вызывающий.
+static int open_builtin_output(const Stage& st, int default_fd) {
+    for (auto it = st.redirs.rbegin(); it != st.redirs.rend(); ++it) {
+        if (it->fd != STDOUT_FILENO) continue;
+        int fd = open(it->path.c_str(), it->flags | O_CLOEXEC, 0644);
+        if (fd < 0) perror(it->path.c_str());
+        return fd;
+    }
+    return fcntl(default_fd, F_DUPFD_CLOEXEC, 0);
+}
+
+// Встроенная команда пишет прямо в fd и закрывает его по завершении,
+// чтобы следующая стадия получила EOF.
+static void builtin_stage_main(const Args& args, int fd) {
+    {
+        FdOutBuf buf(fd);
+        ostream out(&buf);
+        run_builtin(args, out, fd);
+    }
+    close(fd);
+}
+
+// Потоки встроенных стадий переднего плана живут всё время работы шелла:
+// std::thread на каждую стадию — это выделение памяти под его состояние
+// и копия Args. Стадия получает свободный поток, argv передаётся по
+// указателю (строка живёт в parse_cache до конца выполнения), и после
+// прогрева конвейер со встроенной командой не обращается к куче.
+// Объекты потоков не освобождаются: при выходе они ещё ждут работу.
+struct StageWorker {
+    mutex m;
+    condition_variable cv;
+    const Args* args = nullptr;   // не nullptr — стадия выполняется
+    int fd = -1;
+};
+
+vector<StageWorker*> stage_workers;
+
+static void stage_worker_main(StageWorker* w) {
+    unique_lock<mutex> lock(w->m);
+    for (;;) {
+        w->cv.wait(lock, [w] { return w->args != nullptr; });
+        const Args* args = w->args;
+        int fd = w->fd;
+        lock.unlock();
+        builtin_stage_main(*args, fd);
+        lock.lock();
+        w->args = nullptr;
+        w->cv.notify_all();
+    }
+}
+
+// Стадии одного конвейера идут одновременно (они связаны pipe'ами),
+// поэтому k-я встроенная стадия берёт k-й поток, и пул растёт до
+// наибольшего числа встроенных стадий в одном конвейере.
+static void start_builtin_stage(size_t k, const Args& args, int fd) {
+    while (stage_workers.size() <= k) {
+        auto* w = new StageWorker;
+        stage_workers.push_back(w);
+        thread(stage_worker_main, w).detach();
+    }
+    StageWorker* w = stage_workers[k];
+    lock_guard<mutex> lock(w->m);
+    w->args = &args;
+    w->fd = fd;
+    w->cv.notify_all();
+}
+
+static void wait_builtin_stage(size_t k) {
+    StageWorker* w = stage_workers[k];
+    unique_lock<mutex> lock(w->m);
+    w->cv.wait(lock, [w] { return w->args == nullptr; });
+}
+
+// Стадия фонового задания: вывод уже посчитан в основном потоке, поток
+// только дописывает его в fd и не трогает состояние шелла.
+static void background_stage_main(string text, int fd) {
+    {
+        FdOutBuf buf(fd);
+        ostream out(&buf);
+        out.write(text.data(), text.size());
+    }
+    close(fd);
+}
+
+// Встроенные команды, которые меняют хеш команд, идут только в основном
+// потоке: соседняя стадия в потоке (\\hash) обходит ту же таблицу.
+static bool runs_in_main_thread(const Args& args) {
+    return args[0] == "\\rehash" ||
+           (args[0] == "\\hash" && args.size() > 1 && args[1] == "-r");
+}
+
+// Запускает все стадии сразу и ждёт их; коды возврата попадают в pipe_status.
+// Внешние стадии порождаются через spawn_process, встроенные выполняются
+// в потоках шелла без отдельного процесса. Фоновый конвейер получает свою
+// группу процессов и уходит в таблицу заданий вместо ожидания.
+void run_pipeline(const Pipeline& pl, string_view command, bool background) {
+    pmr::memory_resource* mem = &command_arena;
+    int pipe_size = pl.pipe_size < 0 ? default_pipe_size : pl.pipe_size;
+    size_t n = pl.stages.size();
+    pmr::vector<int> fds(2 * (n - 1), -1, mem);
+
+    // O_CLOEXEC: потомки получают только свои концы через dup2,
+    // остальные дескрипторы конвейера закрываются при exec.
+    for (size_t i = 0; i + 1 < n; ++i) {
+        if (pipe2(&fds[2 * i], O_CLOEXEC) < 0) {
+            perror("pipe2");
+            for (int fd : fds)
+                if (fd >= 0) close(fd);
+            return;
+        }
+        if (pipe_size > 0 &&
+            fcntl(fds[2 * i + 1], F_SETPIPE_SZ, pipe_size) < 0) {
+            static bool warned = false;
+            if (!warned) {
+                perror("F_SETPIPE_SZ");
+                warned = true;
+            }
+        }
+    }
+
+    pmr::vector<pid_t> pids(n, -1, mem);
+    pmr::vector<int> status(n, 0, mem);
+    pmr::vector<pair<size_t, int>> builtin_stages(mem);
+    pid_t pgid = background ? 0 : -1;
+
+    for (size_t i = 0; i < n; ++i) {
+        const Stage& st = pl.stages[i];
+
+        if (is_builtin(st.args[0])) {
+            int out = open_builtin_output(
+                st, i + 1 < n ? fds[2 * i + 1] : STDOUT_FILENO);
+            if (out < 0)
+                status[i] = 1;
+            else
+                builtin_stages.emplace_back(i, out);
+            continue;
+        }
+
+        pmr::vector<Redirect> redirs(mem);
+        if (i > 0) redirs.emplace_back(STDIN_FILENO, "", 0, fds[2 * (i - 1)]);
+        if (i + 1 < n) redirs.emplace_back(STDOUT_FILENO, "", 0, fds[2 * i + 1]);
+        // Фоновое задание не должно читать терминал
+        if (background && i == 0)
+            redirs.emplace_back(STDIN_FILENO, "/dev/null", O_RDONLY, -1);
+        // Явные перенаправления стадии применяются после конвейерных
+        redirs.insert(redirs.end(), st.redirs.begin(), st.redirs.end());
+
+        const string& file = lookup_command_cached(st.args[0], st.resolved);
+        if (file.empty()) {
+            cout << st.args[0] << ": command not found" << endl;
+            status[i] = 127;
+            continue;
+        }
+
+        pmr::vector<char*> c_args(mem);
+        for (auto& a : st.args)
+            c_args.push_back(const_cast<char*>(a.c_str()));
+        c_args.push_back(nullptr);
+
+        int err;
+        pids[i] = spawn_process(file.c_str(), c_args.data(), redirs, err,
+                                pgid);
+        if (pids[i] < 0 && err == SPAWN_EREDIR) {
+            status[i] = 1;
+        } else if (pids[i] < 0) {
+            cout << st.args[0] << ": " << strerror(err) << endl;
+            status[i] = (err == ENOENT) ? 127 : 126;
+        } else if (pgid == 0) {
+            pgid = pids[i];
+        }
+    }
+
+    // Потоки стартуют после всех lookup_command, а до них основной поток
+    // выполняет стадии, меняющие хеш команд (runs_in_main_thread; вывода
+    // у них нет, так что ждать читателя они не могут). Остальные встроенные
+    // команды хеш только читают (\\l ищет программы через find_in_path),
+    // а основной поток до их завершения только ждёт потомков.
+    cout.flush();
+    pmr::vector<thread> threads(mem);
+    size_t workers = 0;
+    for (auto& [i, fd] : builtin_stages) {
+        if (!background && runs_in_main_thread(pl.stages[i].args)) {
+            builtin_stage_main(pl.stages[i].args, fd);
+            fd = -1;
+        }
+    }
+    for (auto& [i, fd] : builtin_stages) {
+        if (fd < 0) continue;
+        if (!background) {
+            start_builtin_stage(workers++, pl.stages[i].args, fd);
+            continue;
+        }
+        // Фоновое задание переживает эту строку, а следующие меняют хеш
+        // команд, таблицу заданий и кеши. Поэтому встроенная команда
+        // выполняется сразу, в основном потоке, и в поток уходит только
+        // запись её вывода, который может ждать читателя сколько угодно.
+        ostringstream text;
+        run_builtin(pl.stages[i].args, text, fd);
+        threads.emplace_back(background_stage_main, text.str(), fd);
+    }
+
+    for (int fd : fds) close(fd);
+
+    if (background) {
+        // Потоки фонового задания дописывают вывод сами
+        for (auto& t : threads) t.detach();
+        vector<pid_t> job_pids;
+        for (pid_t p : pids)
+            if (p > 0) job_pids.push_back(p);
+        if (job_pids.empty()) {
+            pipe_status.assign(status.begin(), status.end());
+            return;
+        }
+        add_job(pgid, move(job_pids), string(command));
+        return;
+    }
+
+    wait_children(pids, status);
+    for (size_t k = 0; k < workers; ++k) wait_builtin_stage(k);
+
+    pipe_status.assign(status.begin(), status.end());
+}
+
+// Размер вида 1048576, 256K или 1M.
+static int parse_size(const pmr::string& s) {
+    char* end;
+    long v = strtol(s.c_str(), &end, 10);
+    if (end == s.c_str() || v <= 0) return -1;
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') shift = 10, ++end;
+    else if (*end == 'M' || *end == 'm') shift = 20, ++end;
+    // Проверка до сдвига: переполнение long — неопределённое поведение
+    if (*end != '\0' || v > (INT32_MAX >> shift)) return -1;
+    return static_cast<int>(v << shift);
+}
+
+// ================= Кеш разобранных строк =================
+
+// Скрипты и циклы гоняют одни и те же строки. Разобранная строка —
+// стадии с argv и перенаправлениями, а после первого запуска и найденные
+// программы (Stage::resolved) — лежит в LRU-кеше по хешу строки, и повтор
+// идёт сразу на запуск, минуя лексер, разбор и поиск в хеше команд.
+// Устаревание:
+//  - если при разборе раскрывалась ~, а HOME или поколение снимка
+//    пользователей с тех пор сменились, строка разбирается заново;
+//  - программы перепроверяются при каждом запуске (lookup_command_cached):
+//    смена PATH или mtime каталога из PATH ведёт к новому поиску.
+// Записи живут в общем пуле: вытесненная отдаёт память следующей, так что
+// после прогрева и промахи не обращаются к куче.
+
+struct ParsedSegment {
+    Pipeline pl;
+    bool background = false;
+    size_t begin = 0, length = 0;   // текст команды в ParsedLine::line
+
+    explicit ParsedSegment(pmr::memory_resource* mem) : pl(mem) {}
+};
+
+struct ParsedLine {
+    pmr::string line;
+    size_t hash = 0;
+    pmr::vector<ParsedSegment> segments;
+    bool cacheable = true;   // \pipesz правит стадии при запуске
+    bool expands = false;
+    pmr::string home;        // HOME на момент разбора, если expands
+    unsigned long users_generation = 0;
+
+    explicit ParsedLine(pmr::memory_resource* mem)
+        : line(mem), segments(mem), home(mem) {}
+};
+
+const size_t PARSE_CACHE_SIZE = 256;
+
+struct ParseCache {
+    pmr::unsynchronized_pool_resource pool;
+    pmr::list<ParsedLine> lru{&pool};   // в начале — самая свежая
+    pmr::unordered_map<size_t, pmr::list<ParsedLine>::iterator> index{&pool};
+    unsigned long lookups = 0;
+    unsigned long hits = 0;
+    unsigned long invalidations = 0;
+    unsigned long evictions = 0;
+};
+
+ParseCache parse_cache;
+
+static unsigned long current_users_generation() {
+    auto snapshot = users_snapshot();
+    return snapshot ? snapshot->generation : 0;
+}
+
+static void parse_cache_erase(pmr::list<ParsedLine>::iterator it) {
+    auto idx = parse_cache.index.find(it->hash);
+    if (idx != parse_cache.index.end() && idx->second == it)
+        parse_cache.index.erase(idx);
+    parse_cache.lru.erase(it);
+}
+
+static ParsedLine* parse_cache_find(const string& input, size_t hash) {
+    ++parse_cache.lookups;
+    auto idx = parse_cache.index.find(hash);
+    if (idx == parse_cache.index.end()) return nullptr;
+    auto it = idx->second;
+    if (string_view(it->line) != input) return nullptr;   // коллизия хеша
+
+    if (it->expands) {
+        const char* home = getenv("HOME");
+        if (string_view(it->home) != (home ? home : "") ||
+            it->users_generation != current_users_generation()) {
+            ++parse_cache.invalidations;
+            parse_cache_erase(it);
+            return nullptr;
+        }
+    }
+    parse_cache.lru.splice(parse_cache.lru.begin(), parse_cache.lru, it);
+    ++parse_cache.hits;
+    return &*it;
+}
+
+// Разбирает строку в новую запись в начале LRU. nullptr — ошибка, она
+// уже выведена. Токены смотрят в input и в lexer.buf; execute_command не
+// вызывается рекурсивно, так что Lexer один на шелл.
+static ParsedLine* parse_line(const string& input, size_t hash) {
+    static Lexer lexer;
+    string error;
+    if (!tokenize(input, lexer, error)) {
+        cout << "kubsh: " << error << endl;
+        return nullptr;
+    }
+
+    const vector<Token>& tokens = lexer.tokens;
+    auto separator = [&](size_t i) {
+        return tokens[i].kind == TokKind::Semi || tokens[i].kind == TokKind::Amp;
+    };
+    // Как в sh: пустая команда перед ; или & — ошибка всей строки
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (separator(i) && (i == 0 || separator(i - 1))) {
+            cout << "kubsh: syntax error near unexpected token `"
+                 << tokens[i].text << "'" << endl;
+            return nullptr;
+        }
+    }
+
+    pmr::memory_resource* mem = &parse_cache.pool;
+    auto& lru = parse_cache.lru;
+    ParsedLine& parsed = lru.emplace_front(mem);
+    parsed.line = input;
+    parsed.hash = hash;
+
+    size_t begin = 0;
+    for (size_t i = 0; i <= tokens.size(); ++i) {
+        if (i < tokens.size() && !separator(i)) continue;
+        if (i > begin) {
+            ParsedSegment& seg = parsed.segments.emplace_back(mem);
+            const char* from = tokens[begin].src.data();
+            const char* to = tokens[i - 1].src.data() + tokens[i - 1].src.size();
+            seg.begin = from - input.data();
+            seg.length = to - from;
+            seg.background = i < tokens.size() && tokens[i].kind == TokKind::Amp;
+            if (!parse_pipeline(&tokens[begin], i - begin, seg.pl, error)) {
+                cout << "kubsh: " << error << endl;
+                lru.pop_front();
+                return nullptr;
+            }
+            parsed.expands |= seg.pl.expands;
+            if (!seg.pl.stages.empty() && seg.pl.stages[0].args[0] == "\\pipesz")
+                parsed.cacheable = false;
+        }
+        begin = i + 1;
+    }
+
+    if (parsed.expands) {
+        const char* home = getenv("HOME");
+        parsed.home = home ? home : "";
+        parsed.users_generation = current_users_generation();
+    }
+    if (!parsed.cacheable) return &parsed;
+
+    auto idx = parse_cache.index.find(hash);
+    if (idx != parse_cache.index.end()) parse_cache_erase(idx->second);
+    parse_cache.index.emplace(hash, lru.begin());
+    if (lru.size() > PARSE_CACHE_SIZE) {
+        parse_cache_erase(prev(lru.end()));
+        ++parse_cache.evictions;
+    }
+    return &parsed;
+}
+
+// \parsecache — статистика кеша разобранных строк.
+void builtin_parsecache(ostream& out) {
+    unsigned long lookups = parse_cache.lookups;
+    out << "parse cache: " << parse_cache.index.size() << "/" << PARSE_CACHE_SIZE
+        << " lines, lookups " << lookups << ", hits " << parse_cache.hits;
+    if (lookups) {
+        char rate[16];
+        snprintf(rate, sizeof(rate), "%.1f%%", 100.0 * parse_cache.hits / lookups);
+        out << " (" << rate << ")";
+    }
+    out << ", invalidations " << parse_cache.invalidations << ", evictions "
+        << parse_cache.evictions << endl;
+}
+
+// ================= Выполнение команд =================
+
+// Одна команда списка (background — завершена '&').
+static void execute_pipeline(Pipeline& pl, string_view command, bool background) {
+    if (pl.stages.empty()) return;
+    Args& args = pl.stages[0].args;
+
+    arena_usage = {command_arena.last_used(), command_arena.high_water(),
+                   command_arena.capacity(), command_arena.block_allocs()};
+
+    // \\pipesz SIZE            — размер буфера для всех следующих конвейеров
+    // \\pipesz SIZE cmd | ...  — только для этого конвейера
+    if (args[0] == "\\pipesz") {
+        if (args.size() < 2) {
+            cout << "pipe size: "
+                 << (default_pipe_size ? to_string(default_pipe_size)
+                                       : string("default"))
+                 << endl;
+            return;
+        }
+        int size = parse_size(args[1]);
+        if (size < 0) {
+            cout << "Usage: \\pipesz SIZE[K|M] [pipeline]" << endl;
+            return;
+        }
+        if (args.size() == 2 && pl.stages.size() == 1) {
+            default_pipe_size = size;
+            return;
+        }
+        pl.pipe_size = size;
+        args.erase(args.begin(), args.begin() + 2);
+        if (args.empty()) {
+            cout << "kubsh: syntax error near unexpected token `|'" << endl;
+            return;
+        }
+    }
+
+    if (args[0] == "fg" || args[0] == "bg" || args[0] == "wait") {
+        if (args[0] == "fg") builtin_fg(args);
+        else if (args[0] == "bg") builtin_bg(args);
+        else builtin_wait(args);
+        return;
+    }
+
+    // Одиночная встроенная команда выполняется прямо в основном потоке
+    if (pl.stages.size() == 1 && is_builtin(pl.stages[0].args[0]) &&
+        !background) {
+        cout.flush();
+        int out = open_builtin_output(pl.stages[0], STDOUT_FILENO);
+        if (out >= 0) builtin_stage_main(pl.stages[0].args, out);
+        pipe_status.assign(1, out < 0 ? 1 : 0);
+        return;
+    }
+
+    run_pipeline(pl, command, background);
+}
+
+// Список команд через ; и &: разбор берётся из кеша или делается заново.
+// Во время выполнения кеш не меняется, так что запись живёт до конца.
+void execute_command(const string& input) {
+    size_t hash = std::hash<string_view>{}(input);
+    ParsedLine* parsed = parse_cache_find(input, hash);
+    if (!parsed) parsed = parse_line(input, hash);
+    if (!parsed) return;
+
+    for (auto& seg : parsed->segments) {
+        string_view command(parsed->line.data() + seg.begin, seg.length);
+        execute_pipeline(seg.pl, command, seg.background);
+    }
+    if (!parsed->cacheable) parse_cache.lru.pop_front();
+}
+
+// ================= Бенчмарк запуска =================
+
+// Сравнивает задержку fork+exec и posix_spawn при растущем RSS шелла.
+static double bench_spawn_once(SpawnBackend backend, int iterations) {
+    char true_path[] = "/bin/true";
+    char* argv[] = {true_path, nullptr};
+    SpawnBackend saved = spawn_backend;
+    spawn_backend = backend;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        int err;
+        pid_t pid = spawn_process(true_path, argv, {}, err);
+        if (pid > 0) waitpid(pid, nullptr, 0);
+    }
+    auto elapsed = chrono::steady_clock::now() - start;
+
+    spawn_backend = saved;
+    return chrono::duration<double, micro>(elapsed).count() / iterations;
+}
+
+void run_spawn_benchmark(int iterations) {
+    const size_t sizes_mb[] = {0, 64, 256, 1024};
+    vector<char> ballast;
+
+    cout << "RSS(MiB)   fork+exec(us)   posix_spawn(us)" << endl;
+    for (size_t mb : sizes_mb) {
+        try {
+            ballast.resize(mb << 20);
+        } catch (const bad_alloc&) {
+            cout << mb << ": not enough memory" << endl;
+            break;
+        }
+        // Касаемся каждой страницы, чтобы память действительно попала в RSS
+        for (size_t off = 0; off < ballast.size(); off += 4096)
+            ballast[off] = 1;
+
+        double f = bench_spawn_once(SpawnBackend::Fork, iterations);
+        double s = bench_spawn_once(SpawnBackend::Spawn, iterations);
+        printf("%8zu   %13.1f   %15.1f\n", mb, f, s);
+        fflush(stdout);
+    }
+}
+
+// ================= База учётных записей =================
+
+// passwd/shadow/group/gshadow правятся прямо в шелле, без adduser/userdel:
+// транзакция берёт lckpwdf, читает файлы один раз, меняет строки в памяти
+// и при фиксации записывает каждый изменённый файл целиком во временный
+// "<file>+" с последующим rename. Сколько бы пользователей ни добавилось
+// в транзакции, каждый файл переписывается один раз.
+// account_root — префикс для проверки на копиях файлов (--root DIR).
+
+string account_root;
+
+bool user_source_writable();
+
+// Свои rename'ы passwd, чьи события inotify ещё не пришли (on_vfs_events)
+atomic<unsigned> own_passwd_renames(0);
+
+const long FIRST_UID = 1000;
+const long LAST_UID = 59999;
+const char* const DEFAULT_SHELL = "/bin/bash";
+
+enum AccountFileId { ACC_PASSWD, ACC_SHADOW, ACC_GROUP, ACC_GSHADOW, ACC_COUNT };
+
+struct AccountFile {
+    vector<string> lines;                 // пустая строка — удалённая запись
+    unordered_map<string, size_t> index;  // имя (первое поле) -> строка
+    // group/gshadow: член группы -> строки, где он в списке членов.
+    // Строится при первом удалении в транзакции (index_group_members).
+    unordered_map<string, vector<size_t>> member_lines;
+    bool members_indexed = false;
+    struct stat st{};
+    bool present = false;
+    bool dirty = false;
+};
+
+struct AccountDb {
+    string etc;
+    AccountFile files[ACC_COUNT];
+    unordered_map<long, bool> used_uids;
+    unordered_map<long, bool> used_gids;
+    unordered_map<long, unsigned> primary_users;   // gid -> у скольких основная
+    // Домашние каталоги, которые не удалось отдать владельцу (без root
+    // на копии --root это каждый каталог): одно сообщение на транзакцию.
+    size_t chown_failures = 0;
+    string chown_error;   // первая ошибка: путь и причина
+    long next_id = FIRST_UID;
+    int lock_fd = -1;       // -1 при lckpwdf на настоящем /etc
+    bool locked = false;
+};
+
+// lckpwdf — fcntl-блокировка, она общая для всех потоков процесса.
+// Поток VFS и встроенные \adduser/\deluser дополнительно сериализуются здесь.
+mutex accounts_mutex;
+
+static const char* const account_file_names[ACC_COUNT] = {
+    "passwd", "shadow", "group", "gshadow"};
+
+// Поле номер n строки вида a:b:c (без копирования всей строки в вектор).
+static string account_field(const string& line, int n) {
+    size_t start = 0;
+    while (n-- > 0) {
+        start = line.find(':', start);
+        if (start == string::npos) return "";
+        ++start;
+    }
+    size_t end = line.find(':', start);
+    return line.substr(start, end == string::npos ? string::npos : end - start);
+}
+
+// Как lckpwdf(), но для <root>/etc/.pwd.lock: fcntl-блокировка на запись,
+// ждём не дольше 15 секунд.
+static bool lock_account_files(AccountDb& db) {
+    accounts_mutex.lock();
+    if (account_root.empty()) {
+        db.locked = lckpwdf() == 0;
+        if (!db.locked) accounts_mutex.unlock();
+        return db.locked;
+    }
+    int fd = open((db.etc + "/.pwd.lock").c_str(),
+                  O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        accounts_mutex.unlock();
+        return false;
+    }
+    struct flock fl{};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    for (int i = 0; i < 150; ++i) {
+        if (fcntl(fd, F_SETLK, &fl) == 0) {
+            db.lock_fd = fd;
+            db.locked = true;
+            return true;
+        }
+        if (errno != EACCES && errno != EAGAIN) break;
+        usleep(100000);
+    }
+    int saved = errno;
+    close(fd);
+    accounts_mutex.unlock();
+    errno = saved;
+    return false;
+}
+
+static void unlock_account_files(AccountDb& db) {
+    if (!db.locked) return;
+    if (db.lock_fd >= 0) {
+        close(db.lock_fd);
+        db.lock_fd = -1;
+    } else {
+        ulckpwdf();
+    }
+    db.locked = false;
+    accounts_mutex.unlock();
+}
+
+static void load_account_file(const string& path, AccountFile& f) {
+    ifstream in(path);
+    if (!in || stat(path.c_str(), &f.st) != 0) return;
+    f.present = true;
+    string line;
+    while (getline(in, line)) {
+        size_t colon = line.find(':');
+        if (colon != string::npos && colon > 0)
+            f.index.emplace(line.substr(0, colon), f.lines.size());
+        f.lines.push_back(move(line));
+    }
+}
+
+bool accounts_begin(AccountDb& db, string& error) {
+    db.etc = account_root + "/etc";
+    if (!user_source_writable()) {
+        error = "user source is read-only, accounts in " + db.etc +
+                " are not changed";
+        return false;
+    }
+    if (!lock_account_files(db)) {
+        error = "cannot lock " + db.etc + "/.pwd.lock: " + strerror(errno);
+        return false;
+    }
+    for (int i = 0; i < ACC_COUNT; ++i)
+        load_account_file(db.etc + "/" + account_file_names[i], db.files[i]);
+    if (!db.files[ACC_PASSWD].present || !db.files[ACC_GROUP].present) {
+        error = "cannot read " + db.etc + "/passwd or group";
+        unlock_account_files(db);
+        return false;
+    }
+    for (auto& line : db.files[ACC_PASSWD].lines) {
+        db.used_uids[atol(account_field(line, 2).c_str())] = true;
+        ++db.primary_users[atol(account_field(line, 3).c_str())];
+    }
+    for (auto& line : db.files[ACC_GROUP].lines)
+        db.used_gids[atol(account_field(line, 2).c_str())] = true;
+    return true;
+}
+
+// Правила useradd по умолчанию: строчные буквы, цифры, '_', '-',
+// не с цифры и не с '-', до 32 символов; '$' допустим только в конце.
+bool valid_account_name(const string& name) {
+    if (name.empty() || name.size() > 32) return false;
+    if (!(islower((unsigned char)name[0]) || name[0] == '_')) return false;
+    for (size_t i = 1; i < name.size(); ++i) {
+        unsigned char c = name[i];
+        if (islower(c) || isdigit(c) || c == '_' || c == '-') continue;
+        if (c == '$' && i + 1 == name.size()) continue;
+        return false;
+    }
+    return true;
+}
+
+static void account_append(AccountFile& f, const string& name, string line) {
+    if (!f.present) return;
+    f.index[name] = f.lines.size();
+    f.lines.push_back(move(line));
+    f.dirty = true;
+}
+
+// Аналог adduser --disabled-password --gecos '': своя группа с тем же
+// номером, если он свободен, пароль заблокирован, домашний каталог создаётся.
+bool accounts_add(AccountDb& db, const string& name, string& error) {
+    if (!valid_account_name(name)) {
+        error = "invalid user name '" + name + "'";
+        return false;
+    }
+    if (db.files[ACC_PASSWD].index.count(name)) {
+        error = "user '" + name + "' already exists";
+        return false;
+    }
+    if (db.files[ACC_GROUP].index.count(name)) {
+        error = "group '" + name + "' already exists";
+        return false;
+    }
+
+    long id = db.next_id;
+    while (id <= LAST_UID && (db.used_uids.count(id) || db.used_gids.count(id)))
+        ++id;
+    if (id > LAST_UID) {
+        error = "no free uid/gid in range " + to_string(FIRST_UID) + "-" +
+                to_string(LAST_UID);
+        return false;
+    }
+    db.next_id = id + 1;
+    db.used_uids[id] = true;
+    db.used_gids[id] = true;
+    ++db.primary_users[id];
+
+    string ids = to_string(id);
+    string home = "/home/" + name;
+    long days = time(nullptr) / 86400;
+
+    account_append(db.files[ACC_PASSWD], name,
+                   name + ":x:" + ids + ":" + ids + "::" + home + ":" +
+                       DEFAULT_SHELL);
+    account_append(db.files[ACC_SHADOW], name,
+                   name + ":!:" + to_string(days) + ":0:99999:7:::");
+    account_append(db.files[ACC_GROUP], name, name + ":x:" + ids + ":");
+    account_append(db.files[ACC_GSHADOW], name, name + ":!::");
+
+    string home_path = account_root + home;
+    if (mkdir(home_path.c_str(), 0700) == 0 &&
+        chown(home_path.c_str(), id, id) != 0 && !db.chown_failures++)
+        db.chown_error = home_path + ": " + strerror(errno);
+    return true;
+}
+
+static void report_chown_failures(const AccountDb& db, ostream& out,
+                                  const string& prefix) {
+    if (db.chown_failures)
+        out << prefix << ": cannot chown " << db.chown_failures
+            << " home directories (" << db.chown_error << ")" << endl;
+}
+
+static void account_erase(AccountFile& f, const string& name) {
+    auto it = f.index.find(name);
+    if (it == f.index.end()) return;
+    f.lines[it->second].clear();
+    f.index.erase(it);
+    f.dirty = true;
+}
+
+// Индекс членов групп: без него каждое удаление обходило бы все строки
+// group и gshadow, и пакет из N удалений стоил бы O(N²).
+static void index_group_members(AccountFile& f) {
+    f.members_indexed = true;
+    for (size_t i = 0; i < f.lines.size(); ++i) {
+        const string& line = f.lines[i];
+        size_t colon = line.rfind(':');
+        if (line.empty() || colon == string::npos) continue;
+        for (size_t pos = colon + 1; pos < line.size();) {
+            size_t end = line.find(',', pos);
+            if (end == string::npos) end = line.size();
+            if (end > pos) f.member_lines[line.substr(pos, end - pos)].push_back(i);
+            pos = end + 1;
+        }
+    }
+}
+
+// Убирает name из списка членов (последнее поле) строки group/gshadow.
+static void drop_group_member(AccountFile& f, string& line, const string& name) {
+    size_t colon = line.rfind(':');
+    if (colon == string::npos) return;
+    size_t pos = colon + 1;
+    while (pos < line.size()) {
+        size_t end = line.find(',', pos);
+        if (end == string::npos) end = line.size();
+        if (line.compare(pos, end - pos, name) != 0) {
+            pos = end + 1;
+            continue;
+        }
+        // Вместе с именем уходит одна запятая: следующая, а у последнего
+        // члена — предыдущая
+        if (end < line.size())
+            line.erase(pos, end - pos + 1);
+        else
+            line.erase(pos > colon + 1 ? pos - 1 : pos);
+        f.dirty = true;
+    }
+}
+
+// Аналог userdel без -r: домашний каталог остаётся. Личная группа
+// удаляется, если она ничья больше не основная (db.primary_users).
+bool accounts_del(AccountDb& db, const string& name, string& error) {
+    auto& passwd = db.files[ACC_PASSWD];
+    auto it = passwd.index.find(name);
+    if (it == passwd.index.end()) {
+        error = "user '" + name + "' does not exist";
+        return false;
+    }
+    long uid = atol(account_field(passwd.lines[it->second], 2).c_str());
+    string gid = account_field(passwd.lines[it->second], 3);
+    account_erase(passwd, name);
+    account_erase(db.files[ACC_SHADOW], name);
+    db.used_uids.erase(uid);
+    auto primary = db.primary_users.find(atol(gid.c_str()));
+    if (primary != db.primary_users.end() && --primary->second == 0)
+        db.primary_users.erase(primary);
+
+    auto& group = db.files[ACC_GROUP];
+    auto git = group.index.find(name);
+    if (git != group.index.end() &&
+        account_field(group.lines[git->second], 2) == gid &&
+        !db.primary_users.count(atol(gid.c_str()))) {
+        account_erase(group, name);
+        account_erase(db.files[ACC_GSHADOW], name);
+        db.used_gids.erase(atol(gid.c_str()));
+    }
+
+    // Строки, удалённые выше, в индексе остаются, но уже пусты. Номера
+    // строк не меняются: удаление только очищает строку.
+    for (int i : {ACC_GROUP, ACC_GSHADOW}) {
+        auto& f = db.files[i];
+        if (!f.members_indexed) index_group_members(f);
+        auto mit = f.member_lines.find(name);
+        if (mit == f.member_lines.end()) continue;
+        for (size_t l : mit->second)
+            if (!f.lines[l].empty()) drop_group_member(f, f.lines[l], name);
+        f.member_lines.erase(mit);
+    }
+    return true;
+}
+
+// Меняет поле field (5 — home, 6 — shell) записи passwd пользователя name.
+bool accounts_set_field(AccountDb& db, const string& name, int field,
+                        const string& value, string& error) {
+    auto& passwd = db.files[ACC_PASSWD];
+    auto it = passwd.index.find(name);
+    if (it == passwd.index.end()) {
+        error = "user '" + name + "' does not exist";
+        return false;
+    }
+    string& line = passwd.lines[it->second];
+    size_t start = 0;
+    for (int i = 0; i < field; ++i) {
+        start = line.find(':', start);
+        if (start == string::npos) {
+            error = "malformed passwd entry for '" + name + "'";
+            return false;
+        }
+        ++start;
+    }
+    size_t end = line.find(':', start);
+    line.replace(start, end == string::npos ? string::npos : end - start, value);
+    passwd.dirty = true;
+    return true;
+}
+
+// "<file>+" с правами и владельцем оригинала, fsync, затем rename поверх.
+// Пишет содержимое в path+ и сбрасывает на диск; заменяет файл уже
+// accounts_commit, когда записаны все временные файлы.
+static bool write_account_temp(const string& path, const AccountFile& f) {
+    string tmp = path + "+";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  f.st.st_mode & 07777);
+    if (fd < 0) return false;
+    // Без прав и владельца оригинала замена молча отдала бы файл (и shadow
+    // тоже) пользователю шелла, так что такая фиксация срывается
+    if (fchmod(fd, f.st.st_mode & 07777) != 0 ||
+        fchown(fd, f.st.st_uid, f.st.st_gid) != 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp.c_str());
+        errno = saved;
+        return false;
+    }
+
+    string data;
+    for (auto& line : f.lines) {
+        if (line.empty()) continue;
+        data += line;
+        data += '\n';
+    }
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    bool ok = done == data.size() && fsync(fd) == 0;
+    int saved = errno;
+    close(fd);
+    if (!ok) {
+        unlink(tmp.c_str());
+        errno = saved;
+    }
+    return ok;
+}
+
+// Записывает изменённые файлы и снимает блокировку. Сначала все файлы
+// пишутся во временные path+; rename начинается, только когда записаны
+// все, так что ошибка записи оставляет базу нетронутой. shadow-файлы
+// заменяются первыми: запись в passwd без shadow безопаснее обратного.
+// Если rename сорвался на середине, error перечисляет уже заменённые файлы.
+bool accounts_commit(AccountDb& db, string& error) {
+    static const int order[] = {ACC_SHADOW, ACC_GSHADOW, ACC_GROUP, ACC_PASSWD};
+    vector<int> pending;
+    for (int i : order) {
+        auto& f = db.files[i];
+        if (!f.present || !f.dirty) continue;
+        string path = db.etc + "/" + account_file_names[i];
+        if (!write_account_temp(path, f)) {
+            error = "cannot write " + path + ": " + strerror(errno) +
+                    ", nothing changed";
+            for (int j : pending)
+                unlink((db.etc + "/" + account_file_names[j] + "+").c_str());
+            unlock_account_files(db);
+            return false;
+        }
+        pending.push_back(i);
+    }
+
+    string replaced;
+    bool ok = true;
+    for (int i : pending) {
+        string path = db.etc + "/" + account_file_names[i];
+        string tmp = path + "+";
+        if (!ok) {
+            unlink(tmp.c_str());
+            continue;
+        }
+        bool own = i == ACC_PASSWD && path == passwd_file;
+        if (own) ++own_passwd_renames;
+        if (rename(tmp.c_str(), path.c_str()) != 0) {
+            if (own) --own_passwd_renames;
+            error = "cannot replace " + path + ": " + strerror(errno) +
+                    (replaced.empty() ? ", nothing changed"
+                                      : ", already replaced:" + replaced);
+            unlink(tmp.c_str());
+            ok = false;
+            continue;
+        }
+        db.files[i].dirty = false;
+        replaced += " " + string(account_file_names[i]);
+    }
+    unlock_account_files(db);
+    return ok;
+}
+
+void accounts_abort(AccountDb& db) {
+    unlock_account_files(db);
+}
+
+// ---------- \adduser / \deluser ----------
+
+// \adduser [-f FILE] [NAME...] и \deluser [-f FILE] [NAME...]: все имена
+// из аргументов и файлов (по одному или несколько на строку, # — комментарий)
+// применяются одной транзакцией. По каждому имени печатается результат,
+// в конце — итог; каталоги в ~/users создаст или уберёт поток VFS.
+static bool read_names_file(const string& path, vector<string>& names) {
+    ifstream in(path);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream ss(line);
+        string name;
+        while (ss >> name) names.push_back(name);
+    }
+    return true;
+}
+
+void builtin_account_batch(const Args& args, ostream& out) {
+    bool adding = args[0] == "\\adduser";
+    vector<string> names;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] != "-f") {
+            names.emplace_back(args[i]);
+            continue;
+        }
+        if (i + 1 >= args.size()) {
+            names.clear();
+            break;
+        }
+        if (!read_names_file(string(args[++i]), names)) {
+            out << args[0] << ": " << args[i] << ": " << strerror(errno) << endl;
+            return;
+        }
+    }
+    if (names.empty()) {
+        out << "Usage: " << args[0] << " [-f FILE] [NAME...]" << endl;
+        return;
+    }
+
+    auto start = chrono::steady_clock::now();
+    AccountDb db;
+    string error;
+    if (!accounts_begin(db, error)) {
+        out << args[0] << ": " << error << endl;
+        return;
+    }
+
+    size_t ok = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+        const string& name = names[i];
+        bool done = adding ? accounts_add(db, name, error)
+                           : accounts_del(db, name, error);
+        out << "[" << i + 1 << "/" << names.size() << "] " << name << ": ";
+        if (!done) {
+            out << error << endl;
+            continue;
+        }
+        ++ok;
+        if (adding)
+            out << "added, uid "
+                << account_field(db.files[ACC_PASSWD].lines.back(), 2) << ", "
+                << users_dir << "/" << user_vfs_path(name) << endl;
+        else
+            out << "removed" << endl;
+    }
+
+    report_chown_failures(db, out, string(args[0]));
+    if (ok && !accounts_commit(db, error)) {
+        out << args[0] << ": " << error << endl;
+        return;
+    }
+    if (!ok) accounts_abort(db);
+
+    double ms = chrono::duration<double, milli>(
+        chrono::steady_clock::now() - start).count();
+    out << (adding ? "added " : "removed ") << ok << " of " << names.size()
+        << " users, " << names.size() - ok << " failed, " << ms << " ms"
+        << endl;
+    if (ok) request_vfs_sync();
+}
+
+// ================= VFS =================
+
+// passwd читается через mmap: строки и поля находятся memchr прямо
+// в отображении и отдаются как string_view, без getline/stringstream
+// и без копий на каждое поле. visit получает 7 полей строки. Файл
+// заменяют rename'ом (vipw, useradd, accounts_commit), поэтому
+// отображение старого inode остаётся целым до munmap.
+template <typename F>
+bool scan_passwd(const string& path, F&& visit) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char* p = static_cast<const char*>(map);
+    const char* end = p + size;
+    string_view fields[7];
+    while (p < end) {
+        auto* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+
+        int n = 0;
+        const char* s = p;
+        while (n < 7) {
+            auto* colon = static_cast<const char*>(memchr(s, ':', eol - s));
+            if (!colon || n == 6) {
+                fields[n++] = string_view(s, eol - s);
+                break;
+            }
+            fields[n++] = string_view(s, colon - s);
+            s = colon + 1;
+        }
+        if (n == 7) visit(fields);
+        p = eol + 1;
+    }
+    munmap(map, size);
+    return true;
+}
+
+static bool is_login_shell(string_view shell) {
+    return shell.size() >= 2 && shell.substr(shell.size() - 2) == "sh";
+}
+
+// ---------- Источники пользователей ----------
+
+// Откуда VFS берёт список пользователей (--users-source):
+//  - file: passwd_file через scan_passwd (по умолчанию);
+//  - nss: getpwent, включая LDAP/sssd и прочие модули nsswitch;
+//  - synthetic:N[:CHURN[:MODIFY]]: N сгенерированных пользователей для
+//    проверки сверки на больших числах. За цикл синхронизации доля CHURN
+//    пользователей заменяется новыми, примерно у доли MODIFY меняется shell.
+// Синтетический источник только для чтения: учётные записи по каталогам
+// в ~/users для него не заводятся и не удаляются. Файл, заданный --passwd
+// в обход --root, тоже только читается: база учётных записей пишется
+// в account_root/etc, и сверка с чужим passwd правила бы настоящий /etc.
+enum class UserSource { File, Nss, Synthetic };
+UserSource user_source = UserSource::File;
+
+struct SyntheticUsers {
+    size_t count = 0;
+    double churn = 0;
+    double modify = 0;
+    unsigned long generation = 0;
+};
+
+SyntheticUsers synthetic_users;
+
+bool user_source_writable() {
+    switch (user_source) {
+    case UserSource::File: return passwd_file == account_root + "/etc/passwd";
+    case UserSource::Nss: return true;
+    case UserSource::Synthetic: break;
+    }
+    return false;
+}
+
+const char* user_source_name() {
+    switch (user_source) {
+    case UserSource::File: return "file";
+    case UserSource::Nss: return "nss";
+    case UserSource::Synthetic: break;
+    }
+    return "synthetic";
+}
+
+// file | nss | synthetic:N[:CHURN[:MODIFY]], доли — от 0 до 1.
+bool parse_user_source(const string& spec) {
+    if (spec == "file") {
+        user_source = UserSource::File;
+        return true;
+    }
+    if (spec == "nss") {
+        user_source = UserSource::Nss;
+        return true;
+    }
+    if (spec.compare(0, 10, "synthetic:") != 0) return false;
+
+    SyntheticUsers s;
+    char* end;
+    const char* p = spec.c_str() + 10;
+    s.count = strtoul(p, &end, 10);
+    if (end == p || s.count == 0) return false;
+    if (*end == ':') s.churn = strtod(end + 1, &end);
+    if (*end == ':') s.modify = strtod(end + 1, &end);
+    if (*end != '\0' || s.churn < 0 || s.churn > 1 || s.modify < 0 ||
+        s.modify > 1)
+        return false;
+    synthetic_users = s;
+    user_source = UserSource::Synthetic;
+    return true;
+}
+
+static vector<UserInfo> get_passwd_users() {
+    vector<UserInfo> users;
+    scan_passwd(passwd_file, [&users](const string_view* f) {
+        if (!is_login_shell(f[6])) return;
+        users.push_back({string(f[0]), string(f[2]), string(f[3]),
+                         string(f[5]), string(f[6])});
+    });
+    return users;
+}
+
+static vector<UserInfo> get_nss_users() {
+    vector<UserInfo> users;
+    setpwent();
+    while (struct passwd* pw = getpwent()) {
+        if (!pw->pw_shell || !is_login_shell(pw->pw_shell)) continue;
+        users.push_back({pw->pw_name, to_string(pw->pw_uid),
+                         to_string(pw->pw_gid), pw->pw_dir, pw->pw_shell});
+    }
+    endpwent();
+    return users;
+}
+
+// Поколение g — пользователи с номерами [g*churn*N, g*churn*N + N).
+// Shell пользователя i — zsh, если (i + g) кратно period, иначе bash:
+// при сдвиге g меняется около 2N/period = MODIFY*N пользователей.
+static vector<UserInfo> get_synthetic_users() {
+    const SyntheticUsers& s = synthetic_users;
+    size_t step = static_cast<size_t>(s.churn * s.count);
+    size_t first = s.generation * step;
+    size_t period = s.modify > 0 ? max<size_t>(1, static_cast<size_t>(2 / s.modify + 0.5)) : 0;
+
+    vector<UserInfo> users;
+    users.reserve(s.count);
+    for (size_t i = first; i < first + s.count; ++i) {
+        string n = to_string(i);
+        string id = to_string(100000 + i);
+        bool alt = period && (i + s.generation) % period == 0;
+        users.push_back({"syn" + n, id, id, "/home/syn" + n,
+                         alt ? "/bin/zsh" : "/bin/bash"});
+    }
+    return users;
+}
+
+vector<UserInfo> get_system_users() {
+    switch (user_source) {
+    case UserSource::File: return get_passwd_users();
+    case UserSource::Nss: return get_nss_users();
+    case UserSource::Synthetic: break;
+    }
+    return get_synthetic_users();
+}
+
+// Следующий цикл синхронизации видит следующее поколение синтетических
+// пользователей; у остальных источников состояние не меняется.
+void advance_user_source() {
+    if (user_source == UserSource::Synthetic) ++synthetic_users.generation;
+}
+
+// ~/users держим открытым: все операции VFS идут через *at()-вызовы
+// относительно этого дескриптора, без сборки полных путей и обхода от "/",
+// и продолжают работать, если $HOME переименуют.
+int users_dirfd = -1;
+
+// Путь внутри ~/users для вызовов без *at()-варианта (inotify_add_watch).
+// /proc/self/fd ведёт в сам открытый каталог, так что и такой путь
+// не устаревает при переименовании $HOME или ~/users.
+string users_dirfd_path(const string& rel) {
+    return "/proc/self/fd/" + to_string(users_dirfd) + "/" + rel;
+}
+
+// Раскладка ~/users (--vfs-layout):
+//  - flat: ~/users/<name>;
+//  - sharded: ~/users/<первые две буквы>/<name>, например ~/users/ab/abigail
+//    (однобуквенное имя дополняется '_'). Каталоги верхнего уровня из двух
+//    символов — шарды; каталог с другим именем, созданный прямо в ~/users,
+//    считается новым пользователем и переносится в свой шард. Рядом
+//    поддерживаются ~/users/.index (имя и путь каждого пользователя) и
+//    ~/users/.flat/<name> — символические ссылки для плоского доступа.
+enum class VfsLayout { Flat, Sharded };
+VfsLayout vfs_layout = VfsLayout::Flat;
+
+const char* const VFS_INDEX_FILE = ".index";
+const char* const VFS_FLAT_DIR = ".flat";
+
+static bool is_shard_name(const char* name) {
+    return strlen(name) == 2;
+}
+
+string user_shard(const string& name) {
+    return name.size() >= 2 ? name.substr(0, 2) : name + "_";
+}
+
+// Путь каталога пользователя относительно ~/users.
+string user_vfs_path(const string& name) {
+    if (vfs_layout == VfsLayout::Flat) return name;
+    return user_shard(name) + "/" + name;
+}
+
+// По умолчанию ~/users, другой каталог задаётся --users-root.
+bool create_users_directory() {
+    if (users_dir.empty()) {
+        char* home = getenv("HOME");
+        if (!home) {
+            cerr << "ERROR: HOME environment variable not set!" << endl;
+            return false;
+        }
+        users_dir = string(home) + "/users";
+    }
+   
+    if (mkdir(users_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror(("Failed to create directory " + users_dir).c_str());
+        return false;
+    }
+
+    int fd = open(users_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(users_dir.c_str());
+        return false;
+    }
+    if (users_dirfd >= 0) close(users_dirfd);
+    users_dirfd = fd;
+    return true;
+}
+
+// ---------- Сверка ~/users с passwd ----------
+
+// Сверка инкрементальная: vfs_known хранит пользователей, материализованных
+// в прошлом цикле, и по нему вычисляется дельта. Каталог без записи в passwd:
+//  - если пользователь был известен — его удалили из системы, убираем каталог;
+//  - иначе каталог создали руками — заводим пользователя.
+// Известный пользователь без каталога — каталог удалили, удаляем пользователя.
+
+struct VfsSyncStats {
+    unsigned long cycles = 0;
+    size_t users_scanned = 0;
+    size_t dirs_scanned = 0;
+    size_t added = 0;
+    size_t removed = 0;
+    size_t changed = 0;
+    size_t accounts_added = 0;
+    size_t accounts_removed = 0;
+    size_t files_written = 0;
+    size_t files_unchanged = 0;
+    size_t bytes_written = 0;
+    size_t edits_applied = 0;
+    size_t edits_rejected = 0;
+    size_t edit_conflicts = 0;
+    size_t links_failed = 0;   // ссылки .flat, кроме уже существующих
+    double reconcile_ms = 0;
+};
+
+unordered_map<string, UserInfo> vfs_known;
+bool vfs_initialized = false;
+mutex vfs_stats_mutex;
+VfsSyncStats vfs_last_stats;
+VfsSyncStats vfs_total_stats;
+
+// Перезагрузки по SIGHUP; задержка — от первого HUP пачки до конца
+// обслужившей её синхронизации.
+struct ReloadStats {
+    unsigned long hups = 0;
+    unsigned long reloads = 0;
+    double last_ms = 0;
+    double max_ms = 0;
+    double total_ms = 0;
+};
+
+ReloadStats reload_stats;
+
+static bool same_attrs(const UserInfo& a, const UserInfo& b) {
+    return a.uid == b.uid && a.gid == b.gid && a.home == b.home &&
+           a.shell == b.shell;
+}
+
+// Текущее содержимое файла совпадает с value? Читаем не больше value.size()+1.
+static bool file_has_content(int dirfd, const char* name, const string& value) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    string buf(value.size() + 1, '\0');
+    size_t got = 0;
+    ssize_t n;
+    while (got < buf.size() &&
+           (n = read(fd, &buf[got], buf.size() - got)) > 0)
+        got += n;
+    close(fd);
+    return got == value.size() && buf.compare(0, got, value) == 0;
+}
+
+// Записывает атрибут только при изменении: сравнение с кешем (или с файлом,
+// если кеша нет), затем .name.tmp + renameat — читатель видит либо старое,
+// либо новое значение целиком. owner — пользователь, в чьём каталоге файл:
+// его rename приходит событием inotify, и оно не должно считаться правкой.
+static void write_attr(int dirfd, const char* name, const string& value,
+                       const string* cached, VfsSyncStats& stats,
+                       const string* owner = nullptr) {
+    string own_path = owner ? user_vfs_path(*owner) + "/" + name : string();
+    if (cached ? *cached == value : file_has_content(dirfd, name, value)) {
+        ++stats.files_unchanged;
+        return;
+    }
+
+    string tmp = string(".") + name + ".tmp";
+    int fd = openat(dirfd, tmp.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    size_t done = 0;
+    while (done < value.size()) {
+        ssize_t n = write(fd, value.data() + done, value.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    bool noted = done == value.size() && owner && note_own_vfs_event(own_path);
+    if (done != value.size() || renameat(dirfd, tmp.c_str(), dirfd, name) != 0) {
+        if (noted) cancel_own_vfs_event(own_path);
+        unlinkat(dirfd, tmp.c_str(), 0);
+        return;
+    }
+    ++stats.files_written;
+    stats.bytes_written += value.size();
+}
+
+// mkdir в ~/users; событие о нём — собственное, сверку оно не будит.
+static bool own_mkdir(const string& path) {
+    bool noted = note_own_vfs_event(path);
+    if (mkdirat(users_dirfd, path.c_str(), 0755) == 0) return true;
+    if (noted) cancel_own_vfs_event(path);
+    return false;
+}
+
+// cached — значения, записанные в прошлый раз (nullptr для нового каталога).
+// Возвращает true, если на диске что-то изменилось.
+static bool materialize_user(const UserInfo& u, const UserInfo* cached,
+                             VfsSyncStats& stats) {
+    string path = user_vfs_path(u.username);
+    if (vfs_layout == VfsLayout::Sharded && !cached) {
+        string shard = user_shard(u.username);
+        if (own_mkdir(shard)) watch_shard_dir(shard.c_str());
+        mkdirat(users_dirfd, VFS_FLAT_DIR, 0755);
+        string link = string(VFS_FLAT_DIR) + "/" + u.username;
+        if (symlinkat(("../" + path).c_str(), users_dirfd, link.c_str()) != 0 &&
+            errno != EEXIST)
+            ++stats.links_failed;
+    }
+    bool created = own_mkdir(path);
+    int dirfd = openat(users_dirfd, path.c_str(),
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirfd < 0) return created;
+    size_t written = stats.files_written;
+    write_attr(dirfd, "id", u.uid, cached ? &cached->uid : nullptr, stats,
+               &u.username);
+    write_attr(dirfd, "home", u.home, cached ? &cached->home : nullptr, stats,
+               &u.username);
+    write_attr(dirfd, "shell", u.shell, cached ? &cached->shell : nullptr, stats,
+               &u.username);
+    close(dirfd);
+    return created || stats.files_written != written;
+}
+
+static void remove_flat_link(const string& name) {
+    if (vfs_layout == VfsLayout::Sharded)
+        unlinkat(users_dirfd, (string(VFS_FLAT_DIR) + "/" + name).c_str(), 0);
+}
+
+static void remove_user_dir(const string& name) {
+    string path = user_vfs_path(name);
+    int dirfd = openat(users_dirfd, path.c_str(),
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirfd >= 0) {
+        DIR* dir = fdopendir(dirfd);
+        if (dir) {
+            dirent* e;
+            while ((e = readdir(dir))) {
+                if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+                    unlinkat(dirfd, e->d_name, 0);
+            }
+            closedir(dir);
+        } else {
+            close(dirfd);
+        }
+    }
+    bool noted = note_own_vfs_event(path);
+    if (unlinkat(users_dirfd, path.c_str(), AT_REMOVEDIR) != 0 && noted)
+        cancel_own_vfs_event(path);
+    remove_flat_link(name);
+}
+
+// ---------- Пакетная запись через io_uring ----------
+
+// Холодная сборка VFS — это mkdir и по три open/write/close/rename на
+// каждого пользователя. Через io_uring они уходят пачками по
+// URING_BATCH_USERS пользователей: сначала все mkdirat пачки (и symlinkat
+// для .flat), затем для каждого файла цепочка openat -> write -> close ->
+// renameat на прямых дескрипторах кольца, по системному вызову на фазу.
+// Кольцо поднимается сырыми системными вызовами, без liburing. Каталог,
+// который уже существовал, или файл, на котором цепочка оборвалась,
+// дописываются обычным materialize_user. Если io_uring недоступен
+// (старое ядро, kernel.io_uring_disabled, seccomp) или не умеет нужные
+// операции, весь путь синхронный.
+//
+// Операции с путями ядро всё равно исполняет в потоках io-wq, так что
+// выигрыш есть только при свободных ядрах; на одном CPU кольцо медленнее
+// прямых вызовов (см. --bench-vfs-build). Поэтому по умолчанию Sync,
+// io_uring включается через --vfs-writer uring.
+
+enum class VfsWriter { Sync, Uring };
+VfsWriter vfs_writer = VfsWriter::Sync;
+
+struct Uring {
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+    unsigned sq_local_tail = 0;
+    unsigned queued = 0;
+};
+
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_SLOTS = 256;       // прямые дескрипторы, по одному на файл
+const size_t URING_BATCH_USERS = 64;    // 64 * 3 файла <= URING_SLOTS,
+                                        // 64 * 4 * 3 SQE <= URING_ENTRIES
+
+Uring vfs_ring;
+int vfs_ring_state = 0;   // 0 — не пробовали, 1 — готово, -1 — недоступно
+
+static void uring_close(Uring& r) {
+    if (r.sqes) munmap(r.sqes, r.sqes_size);
+    if (r.cq_ring != MAP_FAILED && r.cq_ring != r.sq_ring)
+        munmap(r.cq_ring, r.cq_ring_size);
+    if (r.sq_ring != MAP_FAILED) munmap(r.sq_ring, r.sq_ring_size);
+    if (r.fd >= 0) close(r.fd);
+    r = Uring();
+}
+
+static bool uring_setup(Uring& r, unsigned entries) {
+    io_uring_params p{};
+    r.fd = static_cast<int>(syscall(SYS_io_uring_setup, entries, &p));
+    if (r.fd < 0) return false;
+    r.entries = p.sq_entries;
+
+    r.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) r.sq_ring_size = r.cq_ring_size = max(r.sq_ring_size, r.cq_ring_size);
+
+    r.sq_ring = mmap(nullptr, r.sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if (r.sq_ring == MAP_FAILED) return false;
+    r.cq_ring = single ? r.sq_ring :
+                mmap(nullptr, r.cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+    if (r.cq_ring == MAP_FAILED) return false;
+    r.sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, r.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    r.sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(r.sq_ring);
+    r.sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    r.sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    r.sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    r.sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    char* cq = static_cast<char*>(r.cq_ring);
+    r.cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    r.cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    r.cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    r.cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    r.sq_local_tail = *r.sq_tail;
+    return true;
+}
+
+static bool uring_supports(const Uring& r, initializer_list<int> ops) {
+    vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    if (syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+    for (int op : ops)
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    return true;
+}
+
+static bool vfs_ring_ready() {
+    if (vfs_writer != VfsWriter::Uring) return false;
+    if (vfs_ring_state) return vfs_ring_state > 0;
+
+    io_uring_rsrc_register reg{};
+    reg.nr = URING_SLOTS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    bool ok = uring_setup(vfs_ring, URING_ENTRIES) &&
+              uring_supports(vfs_ring, {IORING_OP_MKDIRAT, IORING_OP_SYMLINKAT,
+                                        IORING_OP_OPENAT, IORING_OP_WRITE,
+                                        IORING_OP_CLOSE, IORING_OP_RENAMEAT}) &&
+              syscall(SYS_io_uring_register, vfs_ring.fd, IORING_REGISTER_FILES2,
+                      &reg, sizeof(reg)) == 0;
+    if (!ok) uring_close(vfs_ring);
+    vfs_ring_state = ok ? 1 : -1;
+    return ok;
+}
+
+static io_uring_sqe* uring_sqe(Uring& r, uint64_t user_data) {
+    unsigned head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+    if (r.sq_local_tail - head >= r.entries) return nullptr;
+    unsigned idx = r.sq_local_tail & *r.sq_mask;
+    io_uring_sqe* sqe = &r.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    r.sq_array[idx] = idx;
+    ++r.sq_local_tail;
+    ++r.queued;
+    return sqe;
+}
+
+// Отправляет всё поставленное и ждёт все завершения (в цепочках каждый
+// SQE даёт свой CQE, отменённые — с -ECANCELED).
+template <typename F>
+static bool uring_run(Uring& r, F&& on_cqe) {
+    __atomic_store_n(r.sq_tail, r.sq_local_tail, __ATOMIC_RELEASE);
+    unsigned pending = r.queued, submitted = 0, completed = 0;
+    r.queued = 0;
+    while (completed < pending) {
+        long ret = syscall(SYS_io_uring_enter, r.fd, pending - submitted, 1,
+                           IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        submitted += ret;
+        unsigned head = *r.cq_head;
+        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++completed)
+            on_cqe(r.cqes[head & *r.cq_mask]);
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+enum { URING_MKDIR, URING_LINK, URING_OPEN, URING_WRITE, URING_CLOSE, URING_RENAME };
+
+// Материализует новых пользователей (cached == nullptr); changed[i] —
+// результат, как у materialize_user.
+static void materialize_users_batch(const vector<const UserInfo*>& users,
+                                    vector<bool>& changed, VfsSyncStats& stats) {
+    changed.assign(users.size(), false);
+    if (users.empty()) return;
+    if (!vfs_ring_ready()) {
+        for (size_t i = 0; i < users.size(); ++i)
+            changed[i] = materialize_user(*users[i], nullptr, stats);
+        return;
+    }
+
+    if (vfs_layout == VfsLayout::Sharded) {
+        unordered_map<string, bool> shards;
+        for (auto* u : users) shards.emplace(user_shard(u->username), true);
+        for (auto& [shard, unused] : shards)
+            if (own_mkdir(shard)) watch_shard_dir(shard.c_str());
+        mkdirat(users_dirfd, VFS_FLAT_DIR, 0755);
+    }
+
+    static const struct {
+        const char* file;
+        string UserInfo::*member;
+    } attrs[] = {{"id", &UserInfo::uid}, {"home", &UserInfo::home},
+                 {"shell", &UserInfo::shell}};
+
+    Uring& r = vfs_ring;
+    for (size_t first = 0; first < users.size(); first += URING_BATCH_USERS) {
+        size_t n = min(users.size() - first, URING_BATCH_USERS);
+        deque<string> paths;           // адреса строк живут до завершения
+        vector<bool> fallback(n, false);
+        vector<bool> noted(n, false), made(n, false);
+        auto data = [](size_t i, int kind) { return (uint64_t(i) << 3) | kind; };
+        auto index = [](const io_uring_cqe& c) { return size_t(c.user_data >> 3); };
+        auto kind = [](const io_uring_cqe& c) { return int(c.user_data & 7); };
+
+        for (size_t i = 0; i < n; ++i) {
+            const string& name = users[first + i]->username;
+            const string& path = paths.emplace_back(user_vfs_path(name));
+            noted[i] = note_own_vfs_event(path);
+            io_uring_sqe* sqe = uring_sqe(r, data(i, URING_MKDIR));
+            sqe->opcode = IORING_OP_MKDIRAT;
+            sqe->fd = users_dirfd;
+            sqe->addr = reinterpret_cast<uint64_t>(path.c_str());
+            sqe->len = 0755;
+            if (vfs_layout != VfsLayout::Sharded) continue;
+
+            const string& target = paths.emplace_back("../" + path);
+            const string& link = paths.emplace_back(string(VFS_FLAT_DIR) + "/" + name);
+            sqe = uring_sqe(r, data(i, URING_LINK));
+            sqe->opcode = IORING_OP_SYMLINKAT;
+            sqe->fd = users_dirfd;
+            sqe->addr = reinterpret_cast<uint64_t>(target.c_str());
+            sqe->addr2 = reinterpret_cast<uint64_t>(link.c_str());
+        }
+        bool ok = uring_run(r, [&](const io_uring_cqe& c) {
+            if (kind(c) == URING_LINK) {
+                if (c.res < 0 && c.res != -EEXIST) ++stats.links_failed;
+                return;
+            }
+            if (kind(c) != URING_MKDIR) return;
+            if (c.res == 0) made[index(c)] = true;
+            else fallback[index(c)] = true;
+        });
+        // Несостоявшиеся mkdir событий не дадут. Если кольцо сломалось,
+        // часть из них могла пройти незамеченной — это лишь лишняя сверка
+        for (size_t i = 0; i < n; ++i)
+            if (noted[i] && !made[i])
+                cancel_own_vfs_event(user_vfs_path(users[first + i]->username));
+
+        unsigned slot = 0;
+        for (size_t i = 0; ok && i < n; ++i) {
+            if (fallback[i]) continue;
+            const UserInfo& u = *users[first + i];
+            string dir = user_vfs_path(u.username);
+            for (auto& a : attrs) {
+                const string& value = u.*a.member;
+                const string& tmp = paths.emplace_back(dir + "/." + a.file + ".tmp");
+                const string& dst = paths.emplace_back(dir + "/" + a.file);
+
+                io_uring_sqe* sqe = uring_sqe(r, data(i, URING_OPEN));
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->fd = users_dirfd;
+                sqe->addr = reinterpret_cast<uint64_t>(tmp.c_str());
+                sqe->len = 0644;
+                sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+                sqe->file_index = slot + 1;
+
+                sqe = uring_sqe(r, data(i, URING_WRITE));
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+                sqe->fd = slot;
+                sqe->addr = reinterpret_cast<uint64_t>(value.data());
+                sqe->len = value.size();
+
+                sqe = uring_sqe(r, data(i, URING_CLOSE));
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->file_index = slot + 1;
+
+                sqe = uring_sqe(r, data(i, URING_RENAME));
+                sqe->opcode = IORING_OP_RENAMEAT;
+                sqe->fd = users_dirfd;
+                sqe->addr = reinterpret_cast<uint64_t>(tmp.c_str());
+                sqe->len = users_dirfd;
+                sqe->addr2 = reinterpret_cast<uint64_t>(dst.c_str());
+                ++slot;
+            }
+        }
+        if (ok) {
+            ok = uring_run(r, [&](const io_uring_cqe& c) {
+                if (c.res < 0) {
+                    fallback[index(c)] = true;
+                } else if (kind(c) == URING_WRITE) {
+                    stats.bytes_written += c.res;
+                } else if (kind(c) == URING_RENAME) {
+                    ++stats.files_written;
+                }
+            });
+        }
+        if (!ok) {
+            // Кольцо сломалось — оставшееся и дальше пишем синхронно
+            uring_close(vfs_ring);
+            vfs_ring_state = -1;
+            fallback.assign(n, true);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            changed[first + i] = fallback[i] ?
+                materialize_user(*users[first + i], nullptr, stats) : true;
+        }
+        if (!ok) {
+            for (size_t i = first + n; i < users.size(); ++i)
+                changed[i] = materialize_user(*users[i], nullptr, stats);
+            return;
+        }
+    }
+}
+
+// Подкаталоги parent_fd (файлы и служебные .-имена пропускаются).
+template <typename F>
+static void for_each_subdir(int parent_fd, F&& visit) {
+    // Свежий дескриптор: у fdopendir своя позиция чтения
+    int fd = openat(parent_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+    dirent* e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.') continue;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(parent_fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !S_ISDIR(st.st_mode))
+                continue;
+        } else if (e->d_type != DT_DIR) {
+            continue;
+        }
+        visit(e->d_name);
+    }
+    closedir(dir);
+}
+
+// Имена каталогов пользователей в ~/users с учётом раскладки. В шардах
+// каталог чужого шарда пропускается; новые каталоги верхнего уровня
+// переносятся в свой шард (и на каждый шард ставится наблюдение).
+template <typename F>
+static void scan_users_dir(F&& visit) {
+    if (vfs_layout == VfsLayout::Flat) {
+        for_each_subdir(users_dirfd, visit);
+        return;
+    }
+
+    vector<string> unsharded;
+    for_each_subdir(users_dirfd, [&](const char* top) {
+        if (!is_shard_name(top)) {
+            unsharded.push_back(top);
+            return;
+        }
+        watch_shard_dir(top);
+        int fd = openat(users_dirfd, top,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) return;
+        for_each_subdir(fd, [&](const char* name) {
+            if (user_shard(name) == top) visit(name);
+        });
+        close(fd);
+    });
+
+    for (auto& name : unsharded) {
+        string shard = user_shard(name);
+        own_mkdir(shard);
+        watch_shard_dir(shard.c_str());
+        string to = shard + "/" + name;
+        bool from_noted = note_own_vfs_event(name);
+        bool to_noted = note_own_vfs_event(to);
+        if (renameat(users_dirfd, name.c_str(), users_dirfd, to.c_str()) == 0) {
+            visit(name.c_str());
+            continue;
+        }
+        if (from_noted) cancel_own_vfs_event(name);
+        if (to_noted) cancel_own_vfs_event(to);
+    }
+}
+
+// ~/users/.index: "имя<TAB>путь" по пользователям в порядке имён.
+static void write_vfs_index(const unordered_map<string, UserInfo>& known,
+                            VfsSyncStats& stats) {
+    vector<const string*> names;
+    names.reserve(known.size());
+    for (auto& [name, u] : known) names.push_back(&name);
+    sort(names.begin(), names.end(),
+         [](const string* a, const string* b) { return *a < *b; });
+
+    string index;
+    for (auto* name : names) {
+        index += *name;
+        index += '\t';
+        index += user_vfs_path(*name);
+        index += '\n';
+    }
+    write_attr(users_dirfd, VFS_INDEX_FILE, index, nullptr, stats);
+}
+
+// Если ~/users удалили целиком, создаёт его заново и снова ставит наблюдение.
+// Известное состояние сбрасывается: пропажа всего дерева — не повод
+// удалять всех пользователей, VFS просто строится заново.
+static void ensure_users_dir() {
+    struct stat st;
+    if (fstat(users_dirfd, &st) == 0 && st.st_nlink > 0) return;
+    if (create_users_directory()) watch_users_dir();
+    forget_user_watches();
+    vfs_known.clear();
+    vfs_initialized = false;
+}
+
+// ---------- Журнал изменений ----------
+
+// Каждый цикл, изменивший дерево, получает следующий номер поколения.
+// ~/users/.generation — текущее поколение, ~/users/.journal — строки
+// "поколение<TAB>add|remove|modify<TAB>имя", дописываемые в конец.
+// Потребитель запоминает последнее прочитанное поколение и читает только
+// строки после него, вместо полного обхода ~/users. Журнал ограничен
+// VFS_JOURNAL_MAX байтами: при переполнении остаётся новая половина,
+// обрезанная по границе поколения; если первое поколение в журнале больше
+// запомненного + 1, потребителю нужен полный обход.
+
+const char* const VFS_GENERATION_FILE = ".generation";
+const char* const VFS_JOURNAL_FILE = ".journal";
+const size_t VFS_JOURNAL_MAX = 1 << 20;
+
+atomic<unsigned long> vfs_generation(0);
+atomic<size_t> vfs_journal_size(0);
+
+struct VfsJournal {
+    string lines;
+    size_t events = 0;
+};
+
+static void journal_event(VfsJournal& j, const char* op, const string& name) {
+    // Номер поколения проставляется при записи
+    j.lines += op;
+    j.lines += '\t';
+    j.lines += name;
+    j.lines += '\n';
+    ++j.events;
+}
+
+// Поколение переживает перезапуск и пересоздание ~/users: берём
+// максимум из памяти и .generation.
+static void load_vfs_generation() {
+    int fd = openat(users_dirfd, VFS_GENERATION_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    char buf[32] = {};
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n > 0)
+        vfs_generation = max(vfs_generation.load(), strtoul(buf, nullptr, 10));
+}
+
+// Оставляет примерно новую половину журнала, начиная с первого поколения,
+// попавшего в неё целиком.
+static void compact_journal(VfsSyncStats& stats) {
+    int fd = openat(users_dirfd, VFS_JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    string data;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) data.append(buf, n);
+    close(fd);
+
+    size_t cut = data.find('\n', data.size() / 2);
+    if (cut == string::npos) return;
+    ++cut;
+    string gen = data.substr(cut, data.find('\t', cut) - cut);
+    while (cut < data.size() && data.compare(cut, gen.size() + 1, gen + "\t") == 0) {
+        size_t nl = data.find('\n', cut);
+        cut = nl == string::npos ? data.size() : nl + 1;
+    }
+    write_attr(users_dirfd, VFS_JOURNAL_FILE, data.substr(cut), nullptr, stats);
+}
+
+static void commit_vfs_journal(const VfsJournal& j, VfsSyncStats& stats) {
+    if (!j.events) return;
+    string gen = to_string(++vfs_generation);
+
+    string data;
+    data.reserve(j.lines.size() + j.events * (gen.size() + 1));
+    for (size_t pos = 0; pos < j.lines.size();) {
+        size_t nl = j.lines.find('\n', pos);
+        data += gen;
+        data += '\t';
+        data.append(j.lines, pos, nl + 1 - pos);
+        pos = nl + 1;
+    }
+
+    int fd = openat(users_dirfd, VFS_JOURNAL_FILE,
+                    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        // Одна запись с O_APPEND: читатель не увидит половину поколения
+        // от другого писателя, а tail -f получит его целиком
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            done += n;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0) vfs_journal_size = st.st_size;
+        close(fd);
+    }
+    if (vfs_journal_size > VFS_JOURNAL_MAX) {
+        compact_journal(stats);
+        struct stat st;
+        if (fstatat(users_dirfd, VFS_JOURNAL_FILE, &st, 0) == 0)
+            vfs_journal_size = st.st_size;
+    }
+    write_attr(users_dirfd, VFS_GENERATION_FILE, gen + "\n", nullptr, stats);
+}
+
+// ---------- Правка атрибутов через VFS ----------
+
+// Файлы shell и home в каталоге пользователя можно править: inotify
+// сообщает о IN_CLOSE_WRITE/IN_MOVED_TO, цикл событий копит правки
+// (take_vfs_edits), а поток VFS в начале синхронизации проверяет их
+// и применяет одной транзакцией базы учётных записей — тысяча правок
+// за секунду сливается в одну перезапись passwd. id только для чтения.
+// Правка, совпадающая с известным значением (в том числе наша же запись),
+// ничего не делает. Если passwd за то же время поменяли в обход VFS,
+// это конфликт: побеждает passwd, файл перезаписывается.
+
+const unsigned EDIT_SHELL = 1, EDIT_HOME = 2, EDIT_ID = 4;
+
+// Содержимое атрибута без завершающего перевода строки.
+static bool read_attr(int dirfd, const char* name, string& value) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return false;
+    char buf[4097];
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(buf) && (n = read(fd, buf + got, sizeof(buf) - got)) > 0)
+        got += n;
+    close(fd);
+    if (got == sizeof(buf)) return false;
+    value.assign(buf, got);
+    if (!value.empty() && value.back() == '\n') value.pop_back();
+    return true;
+}
+
+static bool listed_in_etc_shells(const string& shell) {
+    ifstream in(account_root + "/etc/shells");
+    if (!in) return true;   // нет /etc/shells — не ограничиваем
+    string line;
+    while (getline(in, line))
+        if (line == shell) return true;
+    return false;
+}
+
+static bool valid_attr_value(unsigned attr, const string& value, string& error) {
+    if (value.empty() || value[0] != '/' ||
+        value.find_first_of(":\n") != string::npos) {
+        error = "must be an absolute path without ':'";
+        return false;
+    }
+    if (attr == EDIT_SHELL) {
+        if (access((account_root + value).c_str(), X_OK) != 0) {
+            error = value + " is not executable";
+            return false;
+        }
+        if (!listed_in_etc_shells(value)) {
+            error = value + " is not listed in /etc/shells";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Возвращает true, если passwd был изменён.
+static bool apply_vfs_edits(unordered_map<string, unsigned>& edits, bool overflow,
+                            const unordered_map<string, const UserInfo*>& sys_index,
+                            VfsJournal& journal, VfsSyncStats& stats) {
+    // Очередь inotify переполнилась — правки могли потеряться, сверяем все
+    if (overflow)
+        for (auto& [name, u] : vfs_known) edits[name] = EDIT_SHELL | EDIT_HOME | EDIT_ID;
+    if (edits.empty()) return false;
+
+    static const struct {
+        unsigned bit;
+        const char* file;
+        int field;
+        string UserInfo::*member;
+    } attrs[] = {
+        {EDIT_SHELL, "shell", 6, &UserInfo::shell},
+        {EDIT_HOME, "home", 5, &UserInfo::home},
+        {EDIT_ID, "id", 2, &UserInfo::uid},
+    };
+
+    AccountDb db;
+    bool in_txn = false;
+    size_t applied = 0;
+    string error;
+    for (auto& [name, mask] : edits) {
+        auto known = vfs_known.find(name);
+        if (known == vfs_known.end()) continue;
+        string path = user_vfs_path(name);
+        int dirfd = openat(users_dirfd, path.c_str(),
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd < 0) continue;
+
+        for (auto& a : attrs) {
+            if (!(mask & a.bit)) continue;
+            const string& current = known->second.*a.member;
+            string value;
+            bool readable = read_attr(dirfd, a.file, value);
+            if (readable && value == current) continue;
+
+            auto sys = sys_index.find(name);
+            if (sys != sys_index.end() && sys->second->*a.member != current) {
+                // Файл перепишет materialize_user значением из passwd
+                ++stats.edit_conflicts;
+                continue;
+            }
+            if (readable && a.bit == EDIT_ID) error = "id is read-only";
+            bool ok = readable && a.bit != EDIT_ID &&
+                      valid_attr_value(a.bit, value, error);
+            if (ok && !in_txn) {
+                in_txn = accounts_begin(db, error);
+                ok = in_txn;
+            }
+            if (ok) ok = accounts_set_field(db, name, a.field, value, error);
+            if (!ok) {
+                if (readable)
+                    cerr << "kubsh: " << users_dir << "/" << path << "/"
+                         << a.file << ": " << error << endl;
+                write_attr(dirfd, a.file, current, nullptr, stats, &name);
+                ++stats.edits_rejected;
+                continue;
+            }
+            known->second.*a.member = value;
+            journal_event(journal, "modify", name);
+            ++applied;
+        }
+        close(dirfd);
+    }
+    edits.clear();
+
+    if (!in_txn) return false;
+    if (!accounts_commit(db, error)) {
+        // Известные значения уже совпадают с файлами; следующий цикл
+        // увидит расхождение с passwd и вернёт файлы к нему
+        cerr << "kubsh: " << error << endl;
+        return false;
+    }
+    stats.edits_applied += applied;
+    return applied > 0;
+}
+
+// Все добавления и удаления цикла — одна транзакция базы учётных записей.
+static void apply_account_changes(const vector<string>& to_add,
+                                  const vector<string>& to_del,
+                                  VfsSyncStats& stats) {
+    if (to_add.empty() && to_del.empty()) return;
+    if (!user_source_writable()) return;
+
+    AccountDb db;
+    string error;
+    if (!accounts_begin(db, error)) {
+        cerr << "kubsh: " << error << endl;
+        return;
+    }
+    size_t added = 0, removed = 0;
+    for (auto& name : to_add) {
+        if (accounts_add(db, name, error)) ++added;
+        else cerr << "kubsh: adduser: " << error << endl;
+    }
+    report_chown_failures(db, cerr, "kubsh: adduser");
+    for (auto& name : to_del) {
+        if (accounts_del(db, name, error)) ++removed;
+        else cerr << "kubsh: userdel: " << error << endl;
+    }
+    if (!accounts_commit(db, error)) {
+        cerr << "kubsh: " << error << endl;
+        return;
+    }
+    stats.accounts_added += added;
+    stats.accounts_removed += removed;
+}
+
+void sync_vfs_with_passwd() {
+    auto start = chrono::steady_clock::now();
+    VfsSyncStats stats;
+
+    ensure_users_dir();
+    if (!vfs_initialized) load_vfs_generation();
+    VfsJournal journal;
+
+    vector<UserInfo> sys_users = get_system_users();
+    unordered_map<string, const UserInfo*> sys_index;
+    sys_index.reserve(sys_users.size());
+    for (auto& u : sys_users) sys_index.emplace(u.username, &u);
+
+    unordered_map<string, unsigned> edits;
+    bool edits_overflow = false;
+    take_vfs_edits(edits, edits_overflow);
+    if (vfs_initialized && user_source_writable() &&
+        apply_vfs_edits(edits, edits_overflow, sys_index, journal, stats)) {
+        sys_users = get_system_users();
+        sys_index.clear();
+        for (auto& u : sys_users) sys_index.emplace(u.username, &u);
+    }
+
+    unordered_map<string, bool> vfs_dirs;   // имя -> есть в passwd
+    scan_users_dir([&](const char* name) {
+        string n = name;
+        bool in_passwd = sys_index.count(n) != 0;
+        vfs_dirs.emplace(move(n), in_passwd);
+    });
+    stats.dirs_scanned = vfs_dirs.size();
+
+    vector<string> to_add, to_del;
+    for (auto& [d, in_passwd] : vfs_dirs) {
+        if (in_passwd) continue;
+        if (vfs_known.count(d)) {
+            remove_user_dir(d);
+            vfs_known.erase(d);
+            journal_event(journal, "remove", d);
+            ++stats.removed;
+        } else {
+            to_add.push_back(d);
+        }
+    }
+
+    if (vfs_initialized) {
+        for (auto it = vfs_known.begin(); it != vfs_known.end();) {
+            if (vfs_dirs.count(it->first) || !sys_index.count(it->first)) {
+                ++it;
+                continue;
+            }
+            to_del.push_back(it->first);
+            it = vfs_known.erase(it);
+        }
+    }
+    apply_account_changes(to_add, to_del, stats);
+
+    // passwd перечитываем, только если сами его поменяли
+    if (stats.accounts_added || stats.accounts_removed) {
+        sys_users = get_system_users();
+        sys_index.clear();
+        for (auto& u : sys_users) sys_index.emplace(u.username, &u);
+    }
+    stats.users_scanned = sys_users.size();
+
+    unordered_map<string, UserInfo> next;
+    next.reserve(sys_users.size());
+    vector<const UserInfo*> fresh;
+    for (auto& u : sys_users) {
+        auto it = vfs_known.find(u.username);
+        bool removed_dir = vfs_initialized && it != vfs_known.end() &&
+                           !vfs_dirs.count(u.username);
+        if (removed_dir) continue;   // userdel не удался — не воскрешаем
+
+        if (it == vfs_known.end()) {
+            fresh.push_back(&u);
+            ++stats.added;
+        } else if (!same_attrs(it->second, u)) {
+            if (materialize_user(u, &it->second, stats))
+                journal_event(journal, "modify", u.username);
+            ++stats.changed;
+        }
+        next.emplace(u.username, u);
+    }
+
+    // Новые каталоги — пачкой. После перезапуска все "новые", но в журнал
+    // попадают только те, чей каталог действительно пришлось создать или
+    // дописать
+    vector<bool> created;
+    materialize_users_batch(fresh, created, stats);
+    for (size_t i = 0; i < fresh.size(); ++i)
+        if (created[i]) journal_event(journal, "add", fresh[i]->username);
+
+    // Удалённые по пропавшему каталогу учётные записи: каталога уже нет,
+    // остаётся ссылка в .flat
+    for (auto& name : to_del) {
+        if (sys_index.count(name)) continue;
+        remove_flat_link(name);
+        journal_event(journal, "remove", name);
+        ++stats.removed;
+    }
+
+    // Пользователи, пропавшие из passwd без каталога в ~/users
+    for (auto& [name, u] : vfs_known) {
+        if (next.count(name) || vfs_dirs.count(name)) continue;
+        journal_event(journal, "remove", name);
+        ++stats.removed;
+    }
+    commit_vfs_journal(journal, stats);
+
+    bool index_stale = !vfs_initialized || stats.added || stats.removed;
+    vfs_known.swap(next);
+    vfs_initialized = true;
+    // После материализации: собственные записи новых каталогов в этом
+    // цикле не порождают событий
+    if (user_source_writable()) sync_user_watches();
+    if (vfs_layout == VfsLayout::Sharded && index_stale)
+        write_vfs_index(vfs_known, stats);
+    // Новый снимок — только если таблица изменилась. Принятые правки из
+    // ~/users в changed не попадают: vfs_known уже хранит новое значение
+    auto snapshot = users_snapshot();
+    if (!snapshot || stats.added || stats.removed || stats.changed ||
+        stats.edits_applied || snapshot->users.size() != sys_users.size())
+        publish_users(move(sys_users));
+    advance_user_source();
+
+    stats.reconcile_ms = chrono::duration<double, milli>(
+        chrono::steady_clock::now() - start).count();
+
+    lock_guard<mutex> lock(vfs_stats_mutex);
+    stats.cycles = ++vfs_total_stats.cycles;
+    vfs_last_stats = stats;
+    vfs_total_stats.users_scanned += stats.users_scanned;
+    vfs_total_stats.dirs_scanned += stats.dirs_scanned;
+    vfs_total_stats.added += stats.added;
+    vfs_total_stats.removed += stats.removed;
+    vfs_total_stats.changed += stats.changed;
+    vfs_total_stats.accounts_added += stats.accounts_added;
+    vfs_total_stats.accounts_removed += stats.accounts_removed;
+    vfs_total_stats.files_written += stats.files_written;
+    vfs_total_stats.files_unchanged += stats.files_unchanged;
+    vfs_total_stats.bytes_written += stats.bytes_written;
+    vfs_total_stats.edits_applied += stats.edits_applied;
+    vfs_total_stats.edits_rejected += stats.edits_rejected;
+    vfs_total_stats.edit_conflicts += stats.edit_conflicts;
+    vfs_total_stats.links_failed += stats.links_failed;
+    vfs_total_stats.reconcile_ms += stats.reconcile_ms;
+}
+
+static void print_sync_stats(ostream& out, const char* title,
+                             const VfsSyncStats& s) {
+    out << title << ": users scanned " << s.users_scanned
+        << ", dirs scanned " << s.dirs_scanned
+        << ", added " << s.added << ", removed " << s.removed
+        << ", changed " << s.changed
+        << ", accounts added " << s.accounts_added
+        << ", accounts removed " << s.accounts_removed
+        << ", files written " << s.files_written
+        << " (" << s.bytes_written << " bytes)"
+        << ", files unchanged " << s.files_unchanged
+        << ", edits applied " << s.edits_applied
+        << ", edits rejected " << s.edits_rejected
+        << ", edit conflicts " << s.edit_conflicts
+        << ", links failed " << s.links_failed
+        << ", reconcile " << s.reconcile_ms << " ms" << endl;
+}
+
+void builtin_vfsstat(ostream& out) {
+    VfsSyncStats last, total;
+    ReloadStats reload;
+    {
+        lock_guard<mutex> lock(vfs_stats_mutex);
+        last = vfs_last_stats;
+        total = vfs_total_stats;
+        reload = reload_stats;
+    }
+    out << "source: " << user_source_name();
+    if (user_source == UserSource::File) out << " " << passwd_file;
+    if (!user_source_writable()) out << " (read-only)";
+    out << ", users dir " << users_dir << endl;
+    out << "generation: " << vfs_generation << ", journal "
+        << vfs_journal_size << " bytes" << endl;
+    out << "cycles: " << total.cycles << endl;
+    print_sync_stats(out, "last", last);
+    print_sync_stats(out, "total", total);
+    out << "reloads: " << reload.reloads << " (SIGHUP received "
+        << reload.hups << "), latency last " << reload.last_ms
+        << " ms, max " << reload.max_ms << " ms, avg "
+        << (reload.reloads ? reload.total_ms / reload.reloads : 0) << " ms"
+        << endl;
+}
+
+// Поток VFS спит на условной переменной и просыпается только по запросу
+// из цикла событий; несколько запросов до пробуждения сливаются в один.
+mutex vfs_mutex;
+condition_variable vfs_cv;
+bool vfs_sync_requested = false;
+
+// SIGHUP читается из signalfd в цикле событий и только отмечает запрос
+// перезагрузки; саму синхронизацию запускает тот же таймер, что сливает
+// события inotify (arm_vfs_debounce), поэтому шторм HUP — одна перезагрузка.
+bool reload_pending = false;
+chrono::steady_clock::time_point reload_since;
+
+void request_vfs_sync() {
+    lock_guard<mutex> lock(vfs_mutex);
+    vfs_sync_requested = true;
+    vfs_cv.notify_one();
+}
+
+// Возвращает true для первого HUP пачки.
+bool request_reload() {
+    {
+        lock_guard<mutex> lock(vfs_stats_mutex);
+        ++reload_stats.hups;
+    }
+    lock_guard<mutex> lock(vfs_mutex);
+    if (reload_pending) return false;
+    reload_pending = true;
+    reload_since = chrono::steady_clock::now();
+    return true;
+}
+
+void vfs_worker_loop() {
+    unique_lock<mutex> lock(vfs_mutex);
+    while (true) {
+        vfs_cv.wait(lock, [] { return vfs_sync_requested || !running; });
+        if (!running) break;
+        vfs_sync_requested = false;
+        bool reload = reload_pending;
+        auto since = reload_since;
+        reload_pending = false;
+        lock.unlock();
+
+        sync_vfs_with_passwd();
+
+        if (reload) {
+            double ms = chrono::duration<double, milli>(
+                chrono::steady_clock::now() - since).count();
+            lock_guard<mutex> stats_lock(vfs_stats_mutex);
+            ++reload_stats.reloads;
+            reload_stats.last_ms = ms;
+            reload_stats.max_ms = max(reload_stats.max_ms, ms);
+            reload_stats.total_ms += ms;
+        }
+        lock.lock();
+    }
+}
+
+void stop_vfs_worker(thread& worker) {
+    {
+        lock_guard<mutex> lock(vfs_mutex);
+        running = false;
+    }
+    vfs_cv.notify_one();
+    worker.join();
+}
+
+// ================= Наблюдение за VFS =================
+
+// Синхронизация запускается по событиям inotify, а не по таймеру:
+//  - каталог с passwd: useradd/vipw пишут passwd+ и переименовывают его
+//    поверх passwd, поэтому следим за каталогом и фильтруем по имени;
+//  - ~/users: создание и удаление каталогов пользователей.
+// Пачка событий сливается в одну синхронизацию через короткий таймер.
+
+const int VFS_DEBOUNCE_MS = 50;
+const int VFS_DEBOUNCE_MAX_MS = 1000;
+
+int vfs_inotify_fd = -1;
+int vfs_debounce_fd = -1;
+int passwd_dir_wd = -1;
+atomic<int> users_dir_wd(-1);
+string passwd_name;
+bool vfs_debounce_armed = false;
+chrono::steady_clock::time_point vfs_debounce_first;
+
+// Наблюдения ставит и снимает поток VFS, события читает цикл событий,
+// поэтому таблицы wd под мьютексом. watched_dirs — все наблюдаемые
+// каталоги по путям относительно ~/users: "" — сам ~/users, шарды,
+// каталоги пользователей.
+mutex user_watch_mutex;
+unordered_map<int, string> watched_dirs;   // wd -> путь
+unordered_map<string, int> watched_wds;    // путь -> wd
+
+// Свои mkdir, rmdir и rename потока VFS внутри ~/users, чьи события ещё
+// не пришли: путь -> сколько событий ждать. Такие события гасятся и не
+// будят следующую, заведомо пустую сверку.
+unordered_map<string, unsigned> own_vfs_events;
+
+static void add_watched_dir_locked(int wd, const string& dir) {
+    auto old = watched_wds.find(dir);
+    if (old != watched_wds.end() && old->second != wd)
+        watched_dirs.erase(old->second);
+    watched_dirs[wd] = dir;
+    watched_wds[dir] = wd;
+}
+
+static void drop_watched_wd_locked(int wd) {
+    auto it = watched_dirs.find(wd);
+    if (it == watched_dirs.end()) return;
+    auto by_dir = watched_wds.find(it->second);
+    if (by_dir != watched_wds.end() && by_dir->second == wd)
+        watched_wds.erase(by_dir);
+    watched_dirs.erase(it);
+}
+
+static void drop_watched_wd(int wd) {
+    lock_guard<mutex> lock(user_watch_mutex);
+    drop_watched_wd_locked(wd);
+}
+
+// Отмечает изменение path до того, как оно сделано. Событие придёт,
+// только если родительский каталог под наблюдением.
+bool note_own_vfs_event(const string& path) {
+    size_t slash = path.rfind('/');
+    string parent = slash == string::npos ? "" : path.substr(0, slash);
+    lock_guard<mutex> lock(user_watch_mutex);
+    if (!watched_wds.count(parent)) return false;
+    ++own_vfs_events[path];
+    return true;
+}
+
+void cancel_own_vfs_event(const string& path) {
+    lock_guard<mutex> lock(user_watch_mutex);
+    auto it = own_vfs_events.find(path);
+    if (it != own_vfs_events.end() && --it->second == 0)
+        own_vfs_events.erase(it);
+}
+
+// true — событие вызвано самим потоком VFS.
+static bool take_own_vfs_event(const inotify_event* ev) {
+    if (!ev->len) return false;
+    lock_guard<mutex> lock(user_watch_mutex);
+    if (own_vfs_events.empty()) return false;
+    auto dir = watched_dirs.find(ev->wd);
+    if (dir == watched_dirs.end()) return false;
+    auto it = own_vfs_events.find(dir->second.empty()
+                                      ? string(ev->name)
+                                      : dir->second + "/" + ev->name);
+    if (it == own_vfs_events.end()) return false;
+    if (--it->second == 0) own_vfs_events.erase(it);
+    return true;
+}
+
+bool watch_users_dir() {
+    if (vfs_inotify_fd < 0) return false;
+    int wd = inotify_add_watch(
+        vfs_inotify_fd, users_dir.c_str(),
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+            IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    users_dir_wd = wd;
+    if (wd < 0) return false;
+    lock_guard<mutex> lock(user_watch_mutex);
+    add_watched_dir_locked(wd, "");
+    return true;
+}
+
+// Шарды ~/users при раскладке sharded. Повторный inotify_add_watch того
+// же каталога возвращает прежний wd, поэтому вызывать можно каждый цикл.
+// ENOENT — шард успели удалить, его уже нечего наблюдать.
+void watch_shard_dir(const char* shard) {
+    if (vfs_inotify_fd < 0) return;
+    int wd = inotify_add_watch(vfs_inotify_fd, users_dirfd_path(shard).c_str(),
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        if (errno != ENOENT)
+            cerr << "kubsh: cannot watch " << users_dir << "/" << shard << ": "
+                 << strerror(errno) << endl;
+        return;
+    }
+    lock_guard<mutex> lock(user_watch_mutex);
+    add_watched_dir_locked(wd, shard);
+}
+
+// Каталоги пользователей — для правок shell/home (apply_vfs_edits).
+unordered_map<int, string> user_wds;
+unordered_map<string, int> user_wd_by_name;
+unordered_map<string, unsigned> pending_edits;
+bool pending_edits_overflow = false;
+bool user_watch_limit_warned = false;
+
+void take_vfs_edits(unordered_map<string, unsigned>& edits, bool& overflow) {
+    lock_guard<mutex> lock(user_watch_mutex);
+    edits.swap(pending_edits);
+    overflow = pending_edits_overflow;
+    pending_edits_overflow = false;
+}
+
+// Ставит наблюдения на новых известных пользователей и снимает с ушедших.
+// Ошибки, кроме ENOENT (каталог уже удалён), сводятся в одно сообщение
+// за вызов: при тысячах пользователей построчный вывод затопил бы терминал.
+void sync_user_watches() {
+    if (vfs_inotify_fd < 0) return;
+    lock_guard<mutex> lock(user_watch_mutex);
+    for (auto it = user_wd_by_name.begin(); it != user_wd_by_name.end();) {
+        if (vfs_known.count(it->first)) {
+            ++it;
+            continue;
+        }
+        inotify_rm_watch(vfs_inotify_fd, it->second);
+        drop_watched_wd_locked(it->second);
+        user_wds.erase(it->second);
+        it = user_wd_by_name.erase(it);
+    }
+    size_t failed = 0;
+    const string* first_failed = nullptr;
+    int first_errno = 0;
+    for (auto& [name, u] : vfs_known) {
+        if (user_wd_by_name.count(name)) continue;
+        int wd = inotify_add_watch(
+            vfs_inotify_fd, users_dirfd_path(user_vfs_path(name)).c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+        if (wd < 0) {
+            if (errno == ENOSPC && !user_watch_limit_warned) {
+                cerr << "kubsh: inotify watch limit reached, edits in some "
+                        "user directories will be ignored "
+                        "(fs.inotify.max_user_watches)" << endl;
+                user_watch_limit_warned = true;
+            } else if (errno != ENOSPC && errno != ENOENT && !failed++) {
+                first_failed = &name;
+                first_errno = errno;
+            }
+            continue;
+        }
+        user_wds[wd] = name;
+        user_wd_by_name[name] = wd;
+        add_watched_dir_locked(wd, user_vfs_path(name));
+    }
+    if (failed)
+        cerr << "kubsh: cannot watch " << failed << " user directories, "
+             << "edits there will be ignored (" << users_dir << "/"
+             << user_vfs_path(*first_failed) << ": " << strerror(first_errno)
+             << ")" << endl;
+}
+
+// ~/users создан заново: старые наблюдения и ожидаемые события ушли с ним.
+void forget_user_watches() {
+    lock_guard<mutex> lock(user_watch_mutex);
+    for (auto& [wd, name] : user_wds) drop_watched_wd_locked(wd);
+    user_wds.clear();
+    user_wd_by_name.clear();
+    own_vfs_events.clear();
+}
+
+// Событие в каталоге пользователя; false — wd не пользовательский.
+// edit — событие относится к файлу атрибута.
+static bool on_user_dir_event(const inotify_event* ev, bool& edit) {
+    edit = false;
+    lock_guard<mutex> lock(user_watch_mutex);
+    auto it = user_wds.find(ev->wd);
+    if (it == user_wds.end()) return false;
+    if (ev->mask & IN_IGNORED) {
+        drop_watched_wd_locked(ev->wd);
+        user_wd_by_name.erase(it->second);
+        user_wds.erase(it);
+        return true;
+    }
+    if (!ev->len) return true;
+    unsigned bit = !strcmp(ev->name, "shell") ? EDIT_SHELL :
+                   !strcmp(ev->name, "home") ? EDIT_HOME :
+                   !strcmp(ev->name, "id") ? EDIT_ID : 0;
+    if (bit) {
+        pending_edits[it->second] |= bit;
+        edit = true;
+    }
+    return true;
+}
+
+// Каждое новое событие откладывает синхронизацию ещё на VFS_DEBOUNCE_MS,
+// чтобы массовый mkdir в ~/users стал одной транзакцией, но не дольше
+// VFS_DEBOUNCE_MAX_MS от первого события пачки.
+static void arm_vfs_debounce() {
+    auto now = chrono::steady_clock::now();
+    if (!vfs_debounce_armed) {
+        vfs_debounce_first = now;
+    } else if (now - vfs_debounce_first >=
+               chrono::milliseconds(VFS_DEBOUNCE_MAX_MS)) {
+        return;
+    }
+    itimerspec once{{0, 0}, {0, VFS_DEBOUNCE_MS * 1000000L}};
+    timerfd_settime(vfs_debounce_fd, 0, &once, nullptr);
+    vfs_debounce_armed = true;
+}
+
+// Часть событий потеряна (переполнение очереди или ошибка чтения):
+// ждать свои больше нельзя, а правки в ~/users перечитываются целиком.
+static void lose_vfs_events() {
+    lock_guard<mutex> lock(user_watch_mutex);
+    pending_edits_overflow = true;
+    own_vfs_events.clear();
+    own_passwd_renames = 0;
+}
+
+void on_vfs_events(uint32_t) {
+    alignas(inotify_event) char buf[16384];
+    bool changed = false;
+    bool users_dir_gone = false;
+    bool edit;
+
+    ssize_t n;
+    for (;;) {
+        n = read(vfs_inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        // Ядро отдаёт события целиком, но за конец прочитанного
+        // не заглядываем и при обрезанном хвосте
+        for (char* p = buf; p + sizeof(inotify_event) <= buf + n;) {
+            auto* ev = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + ev->len;
+            if (p > buf + n) break;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                lose_vfs_events();
+                changed = true;
+            } else if (ev->wd == passwd_dir_wd) {
+                if (!ev->len || passwd_name != ev->name) continue;
+                // Замену passwd из accounts_commit поток VFS уже учёл
+                unsigned own = own_passwd_renames;
+                if ((ev->mask & IN_MOVED_TO) && own &&
+                    own_passwd_renames.compare_exchange_strong(own, own - 1))
+                    continue;
+                changed = true;
+            } else if (take_own_vfs_event(ev)) {
+                continue;
+            } else if (ev->wd == users_dir_wd) {
+                // Переименование ~/users (или $HOME) не мешает: и inotify,
+                // и users_dirfd привязаны к самому каталогу, а не к пути
+                if (ev->mask & IN_MOVE_SELF) continue;
+                if (ev->mask & IN_IGNORED) drop_watched_wd(ev->wd);
+                if (ev->mask & (IN_DELETE_SELF | IN_IGNORED))
+                    users_dir_gone = true;
+                // .generation, .journal, .index и их временные файлы пишет
+                // сам поток VFS; имён пользователей с точки не бывает
+                else if (!ev->len || ev->name[0] != '.')
+                    changed = true;
+            } else if (on_user_dir_event(ev, edit)) {
+                if (edit) changed = true;
+            } else if (ev->mask & IN_IGNORED) {
+                drop_watched_wd(ev->wd);   // шард удалён
+            } else {
+                changed = true;   // шард ~/users
+            }
+        }
+    }
+    if (n < 0 && errno != EAGAIN) {
+        perror("inotify");
+        lose_vfs_events();
+        changed = true;
+    }
+
+    // ~/users удалили — каталог и наблюдение восстановит поток VFS
+    // в начале следующей синхронизации (ensure_users_dir)
+    if (users_dir_gone) changed = true;
+    if (changed) arm_vfs_debounce();
+}
+
+bool start_vfs_watch() {
+    vfs_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    vfs_debounce_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (vfs_inotify_fd < 0 || vfs_debounce_fd < 0) {
+        perror("inotify");
+        return false;
+    }
+
+    size_t slash = passwd_file.rfind('/');
+    string passwd_dir = slash == string::npos ? "." :
+                        slash == 0 ? "/" : passwd_file.substr(0, slash);
+    passwd_name = passwd_file.substr(slash + 1);
+
+    passwd_dir_wd = inotify_add_watch(
+        vfs_inotify_fd, passwd_dir.c_str(),
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+    if (passwd_dir_wd < 0) perror(passwd_dir.c_str());
+    if (!watch_users_dir()) perror(users_dir.c_str());
+    // Первая синхронизация прошла до inotify; поток VFS ещё не запущен
+    if (vfs_layout == VfsLayout::Sharded)
+        for_each_subdir(users_dirfd, [](const char* top) {
+            if (is_shard_name(top)) watch_shard_dir(top);
+        });
+    if (user_source_writable()) sync_user_watches();
+
+    reactor_add(vfs_inotify_fd, EPOLLIN, on_vfs_events);
+    reactor_add(vfs_debounce_fd, EPOLLIN, [](uint32_t) {
+        // EAGAIN — таймер перевзвели между пробуждением epoll и чтением,
+        // он ещё сработает
+        uint64_t ticks;
+        if (read(vfs_debounce_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+            return;
+        vfs_debounce_armed = false;
+        request_vfs_sync();
+    });
+    return true;
+}
+
+// ================= Бенчмарк разбора passwd =================
+
+// Прежний разбор: getline + stringstream + vector<string> на строку.
+static vector<UserInfo> get_system_users_stream(const string& path) {
+    vector<UserInfo> users;
+    ifstream f(path);
+    string line;
+    while (getline(f, line)) {
+        stringstream ss(line);
+        vector<string> p;
+        string part;
+        while (getline(ss, part, ':')) p.push_back(part);
+        if (p.size() >= 7 && is_login_shell(p[6]))
+            users.push_back({p[0], p[2], p[3], p[5], p[6]});
+    }
+    return users;
+}
+
+// Синтетический passwd из lines строк; каждая четвёртая — nologin.
+static bool write_synthetic_passwd(const string& path, size_t lines) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) return false;
+    for (size_t i = 0; i < lines; ++i) {
+        fprintf(f, "user%zu:x:%zu:%zu:User %zu,,,:/home/user%zu:%s\n", i,
+                10000 + i, 10000 + i, i, i,
+                i % 4 == 3 ? "/usr/sbin/nologin" : "/bin/bash");
+    }
+    return fclose(f) == 0;
+}
+
+template <typename F>
+static double bench_best_ms(int rounds, F&& run) {
+    double best = 0;
+    for (int r = 0; r < rounds; ++r) {
+        auto start = chrono::steady_clock::now();
+        run();
+        double ms = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - start).count();
+        if (r == 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+void run_passwd_benchmark(size_t lines) {
+    char path[] = "/tmp/kubsh-passwd-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+    if (!write_synthetic_passwd(path, lines)) {
+        perror(path);
+        unlink(path);
+        return;
+    }
+    struct stat st;
+    stat(path, &st);
+    double mb = st.st_size / 1048576.0;
+
+    size_t n_stream = 0, n_scan = 0, n_users = 0;
+    double t_stream = bench_best_ms(3, [&] {
+        n_stream = get_system_users_stream(path).size();
+    });
+    double t_scan = bench_best_ms(3, [&] {
+        n_scan = 0;
+        scan_passwd(path, [&n_scan](const string_view* f) {
+            n_scan += is_login_shell(f[6]);
+        });
+    });
+    string saved = passwd_file;
+    passwd_file = path;
+    double t_users = bench_best_ms(3, [&] {
+        n_users = get_system_users().size();
+    });
+    passwd_file = saved;
+    unlink(path);
+
+    printf("%zu lines, %.1f MiB, %zu login users\n", lines, mb, n_stream);
+    printf("parser                          ms      MiB/s\n");
+    printf("getline+stringstream      %8.1f   %8.1f\n", t_stream, mb / t_stream * 1000);
+    printf("mmap scan (string_view)   %8.1f   %8.1f\n", t_scan, mb / t_scan * 1000);
+    printf("mmap get_system_users     %8.1f   %8.1f\n", t_users, mb / t_users * 1000);
+    if (n_scan != n_stream || n_users != n_stream)
+        printf("MISMATCH: stream %zu, scan %zu, users %zu\n", n_stream, n_scan,
+               n_users);
+}
+
+// ================= Бенчмарк лексера =================
+
+// Прежний split_args: istringstream и string на каждое слово.
+static vector<string> split_args_stream(const string& input) {
+    vector<string> args;
+    istringstream iss(input);
+    string token;
+    while (iss >> token) args.push_back(token);
+    return args;
+}
+
+// Разбирает lines строк, похожих на строки скриптов, прежним split_args
+// и tokenize.
+void run_lexer_benchmark(size_t lines) {
+    static const char* const templates[] = {
+        "ls -la /home/user%zu",
+        "grep -n \"pattern %zu\" /var/log/syslog | sort | uniq -c > /tmp/out%zu",
+        "echo 'single quoted %zu' \"double $HOME %zu\" plain\\ word",
+        "cat < /etc/passwd | cut -d: -f1 | head -n %zu >> /tmp/names",
+        "\\users --prefix u%zu --shell /bin/bash",
+        "sleep %zu &",
+        "cd /srv/data%zu; make -j8 all; echo done",
+        "find . -name '*.cpp' -newer build/stamp%zu -print",
+    };
+    const size_t ntemplates = sizeof(templates) / sizeof(templates[0]);
+
+    vector<string> input;
+    input.reserve(lines);
+    size_t bytes = 0;
+    char buf[256];
+    for (size_t i = 0; i < lines; ++i) {
+        snprintf(buf, sizeof(buf), templates[i % ntemplates], i, i);
+        input.emplace_back(buf);
+        bytes += input.back().size() + 1;
+    }
+    double mb = bytes / 1048576.0;
+
+    size_t n_stream = 0, n_lex = 0;
+    double t_stream = bench_best_ms(3, [&] {
+        n_stream = 0;
+        for (auto& line : input) n_stream += split_args_stream(line).size();
+    });
+    Lexer lx;
+    string error;
+    double t_lex = bench_best_ms(3, [&] {
+        n_lex = 0;
+        for (auto& line : input)
+            if (tokenize(line, lx, error)) n_lex += lx.tokens.size();
+    });
+
+    printf("%zu lines, %.1f MiB\n", lines, mb);
+    printf("tokenizer                       ms   Mlines/s      MiB/s   tokens\n");
+    printf("istringstream split     %10.1f %10.2f %10.1f %8zu\n", t_stream,
+           lines / t_stream / 1000, mb / t_stream * 1000, n_stream);
+    printf("string_view lexer       %10.1f %10.2f %10.1f %8zu\n", t_lex,
+           lines / t_lex / 1000, mb / t_lex * 1000, n_lex);
+}
+
+// ================= Бенчмарк поиска особых байтов =================
+
+// Строки по line_bytes байт двух видов: "script" — обычные команды,
+// склеенные через ';' (особый байт в среднем каждые 5–6 байт), и
+// "pasted" — команды с длинными строками в кавычках, как при вставке
+// base64 или JSON. Для каждой доступной реализации scan_special
+// меряется сам поиск (все особые байты подряд) и tokenize целиком.
+void run_scan_benchmark(size_t line_bytes) {
+    const size_t total = 32 << 20;
+    size_t lines = max<size_t>(1, total / line_bytes);
+
+    static const char* const commands[] = {
+        "ls -la /home/user42", "grep -n pattern /var/log/syslog | sort | uniq -c",
+        "cat < /etc/passwd | cut -d: -f1 > /tmp/names", "make -j8 all",
+        "find . -name '*.cpp' -print", "echo \"building $HOME\" && true",
+    };
+    const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    string script, pasted = "echo \"";
+    for (size_t k = 0; script.size() < line_bytes; ++k) {
+        script += commands[k % (sizeof(commands) / sizeof(commands[0]))];
+        script += "; ";
+    }
+    script.resize(line_bytes);
+    for (size_t k = 0; pasted.size() + 30 < line_bytes; ++k) {
+        pasted += b64[(k * 7) % 64];
+        if (k % 900 == 899) pasted += "\" \"";
+    }
+    pasted += "\" | base64 -d > /tmp/blob";
+
+    vector<ScanImpl> impls = {ScanImpl::Scalar};
+    for (ScanImpl impl : {ScanImpl::Sse2, ScanImpl::Avx2})
+        if (impl <= best_scan_impl()) impls.push_back(impl);
+    ScanImpl saved = scan_impl;
+
+    printf("%zu-byte lines, %zu lines (%.0f MiB) per input\n", line_bytes, lines,
+           double(line_bytes) * lines / 1048576);
+    printf("input    impl        scan MiB/s   tokenize MiB/s   tokens\n");
+    for (auto& [name, line] : {pair<const char*, const string&>{"script", script},
+                               pair<const char*, const string&>{"pasted", pasted}}) {
+        size_t expect = 0;
+        for (ScanImpl impl : impls) {
+            set_scan_impl(impl);
+            double mb = double(line.size()) * lines / 1048576;
+
+            size_t hits = 0;
+            double t_scan = bench_best_ms(3, [&] {
+                hits = 0;
+                for (size_t l = 0; l < lines; ++l) {
+                    const char* p = line.data();
+                    size_t n = line.size(), i = 0;
+                    while ((i += scan_special(p + i, n - i)) < n) ++hits, ++i;
+                }
+            });
+
+            Lexer lx;
+            string error;
+            size_t tokens = 0, bytes = 0;
+            double t_lex = bench_best_ms(3, [&] {
+                tokens = bytes = 0;
+                for (size_t l = 0; l < lines; ++l) {
+                    if (!tokenize(line, lx, error)) break;
+                    tokens += lx.tokens.size();
+                    for (auto& t : lx.tokens) bytes += t.text.size();
+                }
+            });
+
+            printf("%-8s %-8s %12.0f %16.0f %8zu\n", name, scan_impl_name(impl),
+                   mb / t_scan * 1000, mb / t_lex * 1000, tokens / lines);
+            size_t check = hits ^ (tokens << 20) ^ (bytes << 40);
+            if (impl == ScanImpl::Scalar) expect = check;
+            else if (check != expect) printf("MISMATCH: %s differs from scalar\n",
+                                             scan_impl_name(impl));
+        }
+    }
+    set_scan_impl(saved);
+}
+
+// ================= Бенчмарк сверки VFS =================
+
+// Прогоняет cycles синхронизаций подряд против выбранного источника
+// (обычно --users-source synthetic:N:CHURN:MODIFY и --users-root на
+// временный каталог) и печатает статистику каждого цикла.
+void run_sync_benchmark(int cycles) {
+    if (!create_users_directory()) return;
+    cout << "source: " << user_source_name() << ", users dir " << users_dir
+         << endl;
+    for (int i = 0; i < cycles; ++i) {
+        sync_vfs_with_passwd();
+        VfsSyncStats last;
+        {
+            lock_guard<mutex> lock(vfs_stats_mutex);
+            last = vfs_last_stats;
+        }
+        string title = "cycle " + to_string(i + 1);
+        print_sync_stats(cout, title.c_str(), last);
+    }
+}
+
+// ================= Бенчмарк холодной сборки VFS =================
+
+static int remove_tree_entry(const char* path, const struct stat*, int,
+                             struct FTW*) {
+    return remove(path);
+}
+
+// Строит ~/users для N синтетических пользователей во временном каталоге
+// (внутри --users-root, если задан, иначе в /tmp) сначала синхронным
+// путём, затем через io_uring, и печатает время каждого прохода. Дерево
+// между проходами удаляется.
+void run_vfs_build_benchmark(long count) {
+    string parent = users_dir.empty() ? "/tmp" : users_dir;
+    parse_user_source("synthetic:" + to_string(count));
+    printf("cold VFS build, %ld users, layout %s\n", count,
+           vfs_layout == VfsLayout::Sharded ? "sharded" : "flat");
+    printf("%-8s %10s %10s %12s\n", "writer", "ms", "files", "bytes");
+
+    for (VfsWriter writer : {VfsWriter::Sync, VfsWriter::Uring}) {
+        string tmpl = parent + "/kubsh-vfs-XXXXXX";
+        if (!mkdtemp(&tmpl[0])) {
+            perror(tmpl.c_str());
+            return;
+        }
+        users_dir = tmpl;
+        vfs_writer = writer;
+        vfs_known.clear();
+        vfs_initialized = false;
+        if (!create_users_directory()) return;
+
+        auto start = chrono::steady_clock::now();
+        sync_vfs_with_passwd();
+        double ms = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - start).count();
+
+        VfsSyncStats last;
+        {
+            lock_guard<mutex> lock(vfs_stats_mutex);
+            last = vfs_last_stats;
+        }
+        const char* name = writer == VfsWriter::Sync ? "sync" :
+                           vfs_ring_state > 0 ? "io_uring" : "fallback";
+        printf("%-8s %10.1f %10zu %12zu\n", name, ms, (size_t)last.files_written,
+               (size_t)last.bytes_written);
+        nftw(tmpl.c_str(), remove_tree_entry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+// ================= main =================
+
+string input_buffer;
+
+void handle_line(const string& input) {
+    if (input == "\\q") {
+        running = false;
+        return;
+    }
+
+    if (!input.empty()) {
+        save_history(input);
+    }
+
+    // Всё, что строка взяла из арены, освобождается одним сбросом
+    execute_command(input);
+    command_arena.reset();
+
+    notify_jobs();
+
+    // ВЫВОДИМ ПРИГЛАШЕНИЕ ПОСЛЕ КАЖДОЙ КОМАНДЫ
+    cout << "> ";
+    cout.flush();
+}
+
+// Выделения в куче основным потоком считаются за весь путь строки: от
+// чтения stdin в буфер до приглашения, включая историю. Первая строка
+// из прочитанного куска получает и выделения самого чтения.
+static void count_line_allocs(unsigned long& since) {
+    arena_stats.last_heap_allocs = thread_heap_allocations - since;
+    arena_stats.heap_free_commands += arena_stats.last_heap_allocs == 0;
+    ++arena_stats.commands;
+    since = thread_heap_allocations;
+}
+
+// Строка из input_buffer копируется в current_line, чья память
+// переиспользуется от строки к строке.
+string current_line;
+
+void on_stdin(uint32_t) {
+    char buf[4096];
+    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+
+    unsigned long allocs = thread_heap_allocations;
+    if (n <= 0) {
+        // EOF: недописанную последнюю строку выполняем, как это делал getline
+        if (!input_buffer.empty()) {
+            current_line.swap(input_buffer);
+            input_buffer.clear();
+            handle_line(current_line);
+            count_line_allocs(allocs);
+        }
+        running = false;
+        return;
+    }
+
+    input_buffer.append(buf, n);
+    size_t nl;
+    while (running && (nl = input_buffer.find('\n')) != string::npos) {
+        current_line.assign(input_buffer, 0, nl);
+        input_buffer.erase(0, nl + 1);
+        handle_line(current_line);
+        count_line_allocs(allocs);
+    }
+}
+
+void on_signal(int sfd) {
+    signalfd_siginfo si;
+    bool child = false;
+    while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGHUP:
+            if (request_reload()) cout << "Configuration reloaded" << endl;
+            arm_vfs_debounce();
+            break;
+        case SIGCHLD:
+            child = true;
+            break;
+        case SIGINT:
+            // Во время команды SIGINT достаётся её группе, шелл его игнорирует
+            if (foreground_depth == 0) {
+                input_buffer.clear();
+                cout << endl << "> ";
+                cout.flush();
+            }
+            break;
+        }
+    }
+    if (child) reap_jobs();
+}
+
+int main(int argc, char* argv[]) {
+    int bench_sync_cycles = 0;
+    long bench_vfs_users = 0;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--fork") {
+            spawn_backend = SpawnBackend::Fork;
+        } else if (arg == "--bench-spawn") {
+            int iterations = (i + 1 < argc) ? atoi(argv[i + 1]) : 200;
+            run_spawn_benchmark(iterations > 0 ? iterations : 200);
+            return 0;
+        } else if (arg == "--bench-lex") {
+            long lines = (i + 1 < argc) ? atol(argv[i + 1]) : 1000000;
+            run_lexer_benchmark(lines > 0 ? lines : 1000000);
+            return 0;
+        } else if (arg == "--bench-scan") {
+            long bytes = (i + 1 < argc) ? atol(argv[i + 1]) : 4096;
+            run_scan_benchmark(bytes > 0 ? bytes : 4096);
+            return 0;
+        } else if (arg == "--lexer-scan" && i + 1 < argc) {
+            string impl = argv[++i];
+            bool ok = impl == "scalar" ? set_scan_impl(ScanImpl::Scalar) :
+                      impl == "sse2" ? set_scan_impl(ScanImpl::Sse2) :
+                      impl == "avx2" ? set_scan_impl(ScanImpl::Avx2) : false;
+            if (!ok) {
+                cerr << "kubsh: --lexer-scan " << impl << ": not supported" << endl;
+                return 2;
+            }
+        } else if (arg == "--bench-passwd") {
+            long lines = (i + 1 < argc) ? atol(argv[i + 1]) : 1000000;
+            run_passwd_benchmark(lines > 0 ? lines : 1000000);
+            return 0;
+        } else if (arg == "--bench-vfs-build") {
+            bench_vfs_users = 100000;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+                bench_vfs_users = max(1L, atol(argv[++i]));
+        } else if (arg == "--bench-sync") {
+            bench_sync_cycles = 5;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+                bench_sync_cycles = max(1, atoi(argv[++i]));
+        } else if (arg == "--root" && i + 1 < argc) {
+            account_root = argv[++i];
+            passwd_file = account_root + "/etc/passwd";
+        } else if (arg == "--passwd" && i + 1 < argc) {
+            passwd_file = argv[++i];
+        } else if (arg == "--users-root" && i + 1 < argc) {
+            users_dir = argv[++i];
+        } else if (arg == "--vfs-layout" && i + 1 < argc &&
+                   (string(argv[i + 1]) == "flat" ||
+                    string(argv[i + 1]) == "sharded")) {
+            vfs_layout = string(argv[++i]) == "flat" ? VfsLayout::Flat
+                                                      : VfsLayout::Sharded;
+        } else if (arg == "--vfs-writer" && i + 1 < argc &&
+                   (string(argv[i + 1]) == "sync" ||
+                    string(argv[i + 1]) == "uring")) {
+            vfs_writer = string(argv[++i]) == "sync" ? VfsWriter::Sync
+                                                     : VfsWriter::Uring;
+        } else if (arg == "--users-source" && i + 1 < argc &&
+                   parse_user_source(argv[i + 1])) {
+            ++i;
+        } else {
+            cerr << "Usage: kubsh [--fork] [--bench-spawn [N]] [--bench-passwd [N]]"
+                    " [--bench-lex [N]]\n"
+                    "             [--bench-scan [BYTES]]"
+                    " [--lexer-scan scalar|sse2|avx2]"
+                    " [--bench-sync [CYCLES]]\n"
+                    "             [--bench-vfs-build [N]]"
+                    " [--vfs-writer sync|uring]\n"
+                    "             [--root DIR] [--passwd PATH] [--users-root DIR]"
+                    "\n             [--vfs-layout flat|sharded]"
+                    " [--users-source file|nss|synthetic:N[:CHURN[:MODIFY]]]"
+                 << endl;
+            return 2;
+        }
+    }
+
+    // После разбора всех опций: --users-source и --users-root могут идти позже
+    if (bench_vfs_users) {
+        run_vfs_build_benchmark(bench_vfs_users);
+        return 0;
+    }
+    if (bench_sync_cycles) {
+        run_sync_benchmark(bench_sync_cycles);
+        return 0;
+    }
+
+    setup_signal_handlers();
    
-    sync_vfs_with_passwd();
-   
-    thread vfs_thread(vfs_monitor_loop);
-   
-    string input;
-   
-    // ВЫВОДИМ ПРИГЛАШЕНИЕ С ">" ПЕРЕД ЦИКЛОМ
-    cout << "> ";
-    cout.flush();
-   
-    while (getline(cin, input)) {
-        if (input == "\\q") break;
-       
-        if (sighup_received) {
-            sighup_received = 0;
-        }
-       
-        if (!input.empty()) {
-            save_history(input);
-        }
-       
-        execute_command(input);
-       
-        // ВЫВОДИМ ПРИГЛАШЕНИЕ ПОСЛЕ КАЖДОЙ КОМАНДЫ
-        cout << "> ";
-        cout.flush();
+    load_history();
+   
+    if (!create_users_directory()) {
+        cerr << "Failed to create users directory" << endl;
+        return 1;
+    }
+   
+    sync_vfs_with_passwd();
+
+    if (!reactor_init()) return 1;
+
+    int sfd = open_signal_fd();
+    if (sfd < 0 || !reactor_add(sfd, EPOLLIN, [sfd](uint32_t) { on_signal(sfd); })) {
+        perror("signalfd");
+        return 1;
+    }
+
+    if (!start_vfs_watch()) return 1;
+
+    // Обычный файл или /dev/null epoll не принимает (EPERM) — такой ввод
+    // всегда готов, его читаем между итерациями цикла без ожидания.
+    bool stdin_pollable = reactor_add(STDIN_FILENO, EPOLLIN, on_stdin);
+    if (stdin_pollable) reactor_input_fd = STDIN_FILENO;
+
+    thread vfs_thread(vfs_worker_loop);
+   
+    // ВЫВОДИМ ПРИГЛАШЕНИЕ С ">" ПЕРЕД ЦИКЛОМ
+    cout << "> ";
+    cout.flush();
+   
+    while (running) {
+        if (stdin_pollable) {
+            reactor_run_once(-1);
+        } else {
+            reactor_run_once(0);
+            on_stdin(EPOLLIN);
+        }
     }
    
     cout << endl << "Exiting kubsh..." << endl;
-    running = false;
-    vfs_thread.join();
+    stop_vfs_worker(vfs_thread);
     return 0;
 }
 